@@ -0,0 +1,670 @@
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "corpus.h"
+#include "hash.h"
+#include "md5.h"
+#include "pool.h"
+#include "resize.h"
+#include "stats.h"
+#include "thumbnail.h"
+
+#if __has_include(<filesystem>)
+  #include <filesystem>
+  namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+  #include <experimental/filesystem>
+  namespace fs = std::experimental::filesystem;
+#else
+  error "Missing the <filesystem> header."
+#endif
+
+// benchmarks for the hot loops and for the whole pipeline
+//
+// every kernel is checked against its reference implementation before
+// it is timed; the run fails when a result drifts too far. the pipeline
+// runs over a synthetic corpus written at startup, the same bytes every
+// time, so numbers from different builds can be compared.
+//
+// usage: swag_bench [--json results.json] [--corpus dir]
+//        --corpus keeps the generated photos in dir instead of a temporary
+//        directory that is removed afterwards
+
+struct result
+{
+    std::string section;
+    std::string subject;
+    std::string name;
+    std::string unit;
+    double value;
+};
+
+static std::vector<result> results;
+
+static double now()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void record(const std::string& section, const std::string& subject, const std::string& name, const char* unit,
+                   double value)
+{
+    results.push_back(result{section, subject, name, unit, value});
+    std::cout << "    " << name << ": " << value << " " << unit << std::endl;
+}
+
+// runs kernel for at least min_time seconds, at least once, and records
+// work units per second
+static void measure(const std::string& section, const std::string& subject, const std::string& name, const char* unit,
+                    double work, std::function<void()> kernel, double min_time = 0.25)
+{
+    unsigned iterations = 0;
+    double start = now(), elapsed;
+
+    do
+    {
+        kernel();
+        iterations++;
+    } while ((elapsed = now() - start) < min_time);
+
+    record(section, subject, name, unit, iterations * work / elapsed);
+}
+
+static std::string json_string(const std::string& s)
+{
+    std::string out = "\"";
+
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static bool write_json(const std::string& filename, bool ok)
+{
+    std::ofstream o(filename);
+
+#ifdef __OPTIMIZE__
+    bool optimized = true;
+#else
+    bool optimized = false;
+#endif
+
+    o << "{\n";
+    o << "  \"simd\": " << json_string(Swag::simd_name(Swag::detect_simd())) << ",\n";
+    o << "  \"threads\": " << std::thread::hardware_concurrency() << ",\n";
+    o << "  \"optimized\": " << (optimized ? "true" : "false") << ",\n";
+    o << "  \"ok\": " << (ok ? "true" : "false") << ",\n";
+    o << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const result& r = results[i];
+
+        o << "    {\"section\": " << json_string(r.section) << ", \"subject\": " << json_string(r.subject)
+          << ", \"name\": " << json_string(r.name) << ", \"value\": " << r.value << ", \"unit\": " << json_string(r.unit) << "}"
+          << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    o << "  ]\n}\n";
+
+    o.close();
+    if (!o)
+    {
+        std::cout << "Could not write " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
+
+struct resize_case
+{
+    unsigned width, height, components;
+    unsigned out_width, out_height;
+};
+
+static const resize_case resize_cases[] = {
+    {750, 500, 3, 300, 200},   // 6000x4000 after scale_denom 8
+    {1000, 667, 3, 300, 200},  // leftover ratio 3.33
+    {562, 1000, 3, 113, 200},  // portrait
+    {640, 480, 1, 267, 200},   // grayscale
+    {120, 90, 3, 267, 200},    // upscale
+    {4000, 3000, 3, 267, 200}, // no decode-time scaling at all
+};
+
+static bool bench_resize()
+{
+    bool ok = true;
+    Swag::simd_level best = Swag::detect_simd();
+
+    std::cout << "resize (best: " << Swag::simd_name(best) << ")" << std::endl;
+
+    for (auto& rc : resize_cases)
+    {
+        std::vector<unsigned char> src = Swag::synthetic_frame(rc.width, rc.height, rc.components, rc.width);
+        std::vector<unsigned char> ref(rc.out_width * rc.out_height * rc.components);
+        std::vector<unsigned char> out(ref.size());
+        double mpix = (double)rc.width * rc.height / 1e6;
+
+        std::cout << "  " << rc.width << "x" << rc.height << "x" << rc.components << " -> " << rc.out_width << "x"
+                  << rc.out_height << std::endl;
+
+        std::string subject = std::to_string(rc.width) + "x" + std::to_string(rc.height) + "x" + std::to_string(rc.components) +
+                              " -> " + std::to_string(rc.out_width) + "x" + std::to_string(rc.out_height);
+        auto run = [&](const char* name, std::function<void()> kernel) {
+            measure("resize", subject, name, "source MPix/s", mpix, kernel);
+        };
+
+        run("double", [&] {
+            Swag::resize_bilinear(rc.components, rc.width, rc.height, rc.out_width, rc.out_height, src.data(), ref.data());
+        });
+
+        for (int level = Swag::SIMD_NONE; level <= best; level++)
+        {
+            Swag::simd_level l = (Swag::simd_level)level;
+            Swag::resize_bilinear_fixed(rc.components, rc.width, rc.height, rc.out_width, rc.out_height, src.data(), out.data(), l);
+
+            int max_error = 0;
+            for (size_t i = 0; i < ref.size(); i++)
+                max_error = std::max(max_error, std::abs((int)out[i] - (int)ref[i]));
+
+            if (max_error > 1)
+            {
+                std::cout << "    " << Swag::simd_name(l) << ": max error " << max_error << " FAILED" << std::endl;
+                ok = false;
+                continue;
+            }
+
+            run(Swag::simd_name(l), [&] {
+                Swag::resize_bilinear_fixed(rc.components, rc.width, rc.height, rc.out_width, rc.out_height, src.data(), out.data(), l);
+            });
+        }
+
+        // separable filters have no reference kernel, but their weights
+        // must sum to one: a flat frame has to come out flat
+        std::vector<unsigned char> flat(src.size(), 77);
+        static const Swag::resize_filter filters[] = {Swag::FILTER_BOX, Swag::FILTER_CATMULL_ROM, Swag::FILTER_LANCZOS3};
+
+        for (Swag::resize_filter f : filters)
+        {
+            Swag::resize_separable(f, rc.components, rc.width, rc.height, rc.out_width, rc.out_height, flat.data(), out.data());
+
+            if (std::count(out.begin(), out.end(), 77) != (long)out.size())
+            {
+                std::cout << "    " << Swag::filter_name(f) << ": flat frame not preserved FAILED" << std::endl;
+                ok = false;
+                continue;
+            }
+
+            run(Swag::filter_name(f), [&] {
+                Swag::resize_separable(f, rc.components, rc.width, rc.height, rc.out_width, rc.out_height, src.data(), out.data());
+            });
+        }
+    }
+
+    return ok;
+}
+
+static bool bench_hash()
+{
+    bool ok = true;
+    Swag::simd_level best = Swag::detect_simd();
+    std::vector<unsigned char> buffer = Swag::synthetic_frame(4096, 1024, 4, 7);
+    double mbytes = buffer.size() / 1e6;
+
+    std::cout << "hash, " << mbytes << " MB (best: " << Swag::simd_name(best) << ")" << std::endl;
+
+    std::string subject = std::to_string(buffer.size()) + " bytes";
+    auto run = [&](const std::string& name, std::function<void()> kernel) {
+        measure("hash", subject, name, "MB/s", mbytes, kernel, 0.5);
+    };
+
+    std::string digest;
+    run("md5", [&] {
+        MD5 md5;
+        md5.update(buffer.data(), buffer.size());
+        digest = md5.finalize().hexdigest();
+    });
+
+    // every level has to agree with the scalar one, whole or fed in odd
+    // sized pieces
+    uint64_t ref_low, ref_high;
+    Swag::fast_hash scalar(Swag::SIMD_NONE);
+    scalar.update(buffer.data(), buffer.size());
+    scalar.digest(ref_low, ref_high);
+
+    for (int level = Swag::SIMD_NONE; level <= best; level++)
+    {
+        Swag::simd_level l = (Swag::simd_level)level;
+        Swag::fast_hash pieces(l);
+        uint64_t low, high;
+
+        for (size_t at = 0, n = 1; at < buffer.size(); at += n, n = n * 3 + 1)
+            pieces.update(buffer.data() + at, std::min(n, buffer.size() - at));
+        pieces.digest(low, high);
+
+        if (low != ref_low || high != ref_high)
+        {
+            std::cout << "    fast128 " << Swag::simd_name(l) << ": digest differs FAILED" << std::endl;
+            ok = false;
+            continue;
+        }
+
+        run(std::string("fast128 ") + Swag::simd_name(l), [&] {
+            Swag::fast_hash h(l);
+            h.update(buffer.data(), buffer.size());
+            h.digest(low, high);
+        });
+    }
+
+    // multi-buffer md5 over the same bytes cut into messages of mixed
+    // sizes, like a folder of photos, after a run of tiny ones that cover
+    // every way the padding can fall
+    std::vector<const unsigned char*> messages;
+    std::vector<size_t> sizes;
+    std::vector<std::string> expected;
+
+    for (size_t at = 0, n = 0; at < buffer.size(); at += sizes.back(), n++)
+    {
+        messages.push_back(buffer.data() + at);
+        if (n < 130)
+            sizes.push_back(n);
+        else
+            sizes.push_back(std::min(buffer.size() - at, (size_t)(100000 + n * 7919 % 300000)));
+
+        MD5 md5;
+        md5.update(messages.back(), sizes.back());
+        expected.push_back(md5.finalize().hexdigest());
+    }
+
+    std::vector<std::string> digests(messages.size());
+    for (int level = Swag::SIMD_NONE; level <= best; level++)
+    {
+        Swag::simd_level l = (Swag::simd_level)level;
+
+        Swag::md5_many(messages.data(), sizes.data(), messages.size(), digests.data(), l);
+        if (digests != expected)
+        {
+            std::cout << "    md5 x" << (l == Swag::SIMD_AVX2 ? 8 : l == Swag::SIMD_SSE2 ? 4 : 1) << " " << Swag::simd_name(l)
+                      << ": digest differs FAILED" << std::endl;
+            ok = false;
+            continue;
+        }
+
+        run(std::string("md5 multi-buffer ") + Swag::simd_name(l), [&] {
+            Swag::md5_many(messages.data(), sizes.data(), messages.size(), digests.data(), l);
+        });
+    }
+
+    return ok;
+}
+
+// path keys: one md5() per input found by the walk
+static bool bench_keys()
+{
+    std::vector<std::string> paths;
+
+    for (unsigned i = 0; i < 10000; i++)
+        paths.push_back("/home/someone/Pictures/2019/holidays/IMG_" + std::to_string(1000 + i) + ".JPG");
+
+    std::cout << "path keys, " << paths.size() << " paths" << std::endl;
+
+    measure("keys", "10000 paths", "md5", "keys/s", paths.size(), [&] {
+        for (auto& p : paths)
+            md5(p);
+    });
+    measure("keys", "10000 paths", "fast128", "keys/s", paths.size(), [&] {
+        for (auto& p : paths)
+            Swag::hash_string(Swag::HASH_FAST128, p);
+    });
+
+    return true;
+}
+
+// every stage of generate_thumbnail on its own, then the whole thing over
+// the corpus serially, streaming and on every core
+static bool bench_pipeline(const std::string& dir, const std::vector<std::string>& files)
+{
+    const std::vector<Swag::corpus_spec>& specs = Swag::default_corpus();
+    bool ok = true;
+
+    fs::create_directory(dir + "/thumbs");
+
+    std::cout << "pipeline, " << files.size() << " images (" << def_scaleheight << "px thumbnails)" << std::endl;
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        const Swag::corpus_spec& spec = specs[i];
+        double mpix = (double)spec.width * spec.height / 1e6;
+        auto load = spec.png ? Swag::load_image_png : Swag::load_image_jpeg;
+        image decoded;
+
+        std::cout << "  " << spec.name << std::endl;
+
+        decoded.in_filename = files[i];
+        decoded.out_filename = dir + "/thumbs/" + spec.name + ".jpg";
+        if (!load(&decoded))
+        {
+            std::cout << "    decode FAILED" << std::endl;
+            ok = false;
+            continue;
+        }
+
+        measure("decode", spec.name, spec.png ? "load_image_png" : "load_image_jpeg", "source MPix/s", mpix, [&] {
+            image img;
+            img.in_filename = files[i];
+            load(&img);
+        });
+
+        if (!spec.png)
+        {
+            // balanced is the default, timed above
+            for (Swag::decode_profile profile : {Swag::PROFILE_FAST, Swag::PROFILE_BEST})
+            {
+                def_profile = profile;
+                measure("decode", spec.name, std::string("load_image_jpeg --profile ") + Swag::profile_name(profile),
+                        "source MPix/s", mpix, [&] {
+                            image img;
+                            img.in_filename = files[i];
+                            load(&img);
+                        });
+            }
+            def_profile = Swag::PROFILE_BALANCED;
+
+            // square thumbnails only decode the MCUs under the crop
+            def_crop = Swag::CROP_CENTER;
+            measure("decode", spec.name, "load_image_jpeg --crop center", "source MPix/s", mpix, [&] {
+                image img;
+                img.in_filename = files[i];
+                load(&img);
+            });
+            def_crop = Swag::CROP_NONE;
+        }
+
+        if (spec.preview)
+        {
+            def_exif = true;
+            measure("decode", spec.name, "load_image_jpeg --exif", "source MPix/s", mpix, [&] {
+                image img;
+                img.in_filename = files[i];
+                load(&img);
+            });
+            def_exif = false;
+        }
+
+        // the frame is in this thread's scratch memory, which the loop above
+        // reused; decode it once more for create_thumbnail, which leaves it be
+        load(&decoded);
+        measure("thumbnail", spec.name, "create_thumbnail", "thumbnails/s", 1, [&] {
+            image img = decoded;
+            Swag::create_thumbnail(&img);
+        });
+
+        if (!spec.png)
+        {
+            // bilinear samples a streamed frame the way it does a whole one,
+            // so both have to write the same files, with one size and with
+            // a chain of them
+            auto written = [&] {
+                std::vector<std::vector<unsigned char>> bytes;
+                for (auto& name : Swag::thumbnail_filenames(decoded.out_filename, Swag::command_line_options()))
+                {
+                    std::ifstream in(name, std::ios::binary);
+                    bytes.emplace_back(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+                }
+                return bytes;
+            };
+
+            for (bool chained : {false, true})
+            {
+                if (chained)
+                    def_bigheights = {2 * (unsigned)def_scaleheight, 4 * (unsigned)def_scaleheight};
+
+                // the largest size picks the decode scale
+                image whole;
+                whole.in_filename = decoded.in_filename;
+                whole.out_filename = decoded.out_filename;
+                if (!load(&whole) || !Swag::create_thumbnail(&whole))
+                    ok = false;
+                auto expected = written();
+
+                image streamed;
+                streamed.in_filename = decoded.in_filename;
+                streamed.out_filename = decoded.out_filename;
+                if (!Swag::stream_thumbnail(&streamed))
+                    ok = false;
+
+                if (written() != expected)
+                {
+                    std::cout << "    stream_thumbnail" << (chained ? " with --sizes" : "")
+                              << " differs from create_thumbnail: FAILED" << std::endl;
+                    ok = false;
+                }
+            }
+            def_bigheights.clear();
+
+            measure("thumbnail", spec.name, "stream_thumbnail", "thumbnails/s", 1, [&] {
+                image img;
+                img.in_filename = decoded.in_filename;
+                img.out_filename = decoded.out_filename;
+                Swag::stream_thumbnail(&img);
+            });
+        }
+
+        // every level of the deep-zoom pyramid from one full size decode
+        measure("tiles", spec.name, "generate_tiles", "source MPix/s", mpix, [&] {
+            image img;
+            img.in_filename = decoded.in_filename;
+            img.out_filename = decoded.out_filename;
+            if (!Swag::generate_tiles(&img))
+                ok = false;
+        });
+    }
+
+    std::cout << "  end to end" << std::endl;
+
+    std::atomic<unsigned> failures(0);
+
+    auto generate_all = [&](WorkPool* pool) {
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            auto job = [&, i] {
+                image img;
+                img.in_filename = files[i];
+                img.out_filename = dir + "/thumbs/" + specs[i].name + ".jpg";
+                if (!Swag::generate_thumbnail(&img))
+                    failures++;
+            };
+
+            if (pool)
+                pool->submit(job);
+            else
+                job();
+        }
+
+        if (pool)
+            pool->wait();
+    };
+
+    // one more pass after the timed ones, counting what it costs in
+    // allocations and page faults once the workers are warm
+    auto account = [&](const std::string& name, WorkPool* pool) {
+        rusage before, after;
+        uint64_t allocations = Swag::stats_allocations();
+
+        getrusage(RUSAGE_SELF, &before);
+        generate_all(pool);
+        getrusage(RUSAGE_SELF, &after);
+
+        allocations = Swag::stats_allocations() - allocations;
+        record("memory", "corpus", name + " allocations", "allocations/image", (double)allocations / files.size());
+        record("memory", "corpus", name + " page faults", "faults/image",
+               (double)(after.ru_minflt - before.ru_minflt) / files.size());
+    };
+
+    measure("end-to-end", "corpus", "serial", "images/s", files.size(), [&] { generate_all(NULL); }, 1.0);
+    account("serial", NULL);
+
+    def_stream = true;
+    measure("end-to-end", "corpus", "serial --stream", "images/s", files.size(), [&] { generate_all(NULL); }, 1.0);
+    account("serial --stream", NULL);
+    def_stream = false;
+
+    def_exif = true;
+    measure("end-to-end", "corpus", "serial --exif", "images/s", files.size(), [&] { generate_all(NULL); }, 1.0);
+    def_exif = false;
+
+    def_crop = Swag::CROP_CENTER;
+    measure("end-to-end", "corpus", "serial --crop center", "images/s", files.size(), [&] { generate_all(NULL); }, 1.0);
+    def_crop = Swag::CROP_NONE;
+
+    // best goes with catmull-rom, as in main
+    def_profile = Swag::PROFILE_FAST;
+    measure("end-to-end", "corpus", "serial --profile fast", "images/s", files.size(), [&] { generate_all(NULL); }, 1.0);
+    def_profile = Swag::PROFILE_BEST;
+    def_filter = Swag::FILTER_CATMULL_ROM;
+    measure("end-to-end", "corpus", "serial --profile best", "images/s", files.size(), [&] { generate_all(NULL); }, 1.0);
+    def_profile = Swag::PROFILE_BALANCED;
+    def_filter = Swag::FILTER_BILINEAR;
+
+    def_quality = 85;
+    def_optimize = def_progressive = true;
+    measure("end-to-end", "corpus", "serial --quality 85 --optimize --progressive", "images/s", files.size(),
+            [&] { generate_all(NULL); }, 1.0);
+    def_quality = 50;
+    def_optimize = def_progressive = false;
+
+    // the library: the same pictures from memory into memory on a single
+    // scratch, which has to give the bytes generate_thumbnail wrote
+    std::vector<std::vector<unsigned char>> sources;
+    for (auto& f : files)
+    {
+        std::ifstream in(f, std::ios::binary);
+        sources.emplace_back(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    Swag::thumbnail_options options = Swag::command_line_options();
+    Swag::thumbnail_scratch scratch;
+    Swag::thumbnail_result result;
+
+    auto make_all = [&] {
+        for (auto& source : sources)
+            if (!Swag::make_thumbnail(source.data(), source.size(), options, scratch, result))
+                failures++;
+    };
+
+    generate_all(NULL);
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        std::ifstream in(dir + "/thumbs/" + specs[i].name + ".jpg", std::ios::binary);
+        std::vector<unsigned char> written((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        if (!Swag::make_thumbnail(sources[i].data(), sources[i].size(), options, scratch, result) ||
+            written != std::vector<unsigned char>(result.outputs.back().data, result.outputs.back().data + result.outputs.back().size))
+        {
+            std::cout << "    make_thumbnail " << specs[i].name << " differs from generate_thumbnail: FAILED" << std::endl;
+            ok = false;
+        }
+    }
+
+    measure("end-to-end", "corpus", "make_thumbnail, memory to memory", "images/s", files.size(), make_all, 1.0);
+
+    uint64_t allocations = Swag::stats_allocations();
+    make_all();
+    record("memory", "corpus", "make_thumbnail allocations", "allocations/image",
+           (double)(Swag::stats_allocations() - allocations) / files.size());
+
+    unsigned cores = std::thread::hardware_concurrency();
+    if (cores > 1)
+    {
+        WorkPool pool(cores);
+        std::string name = "-j " + std::to_string(cores);
+
+        measure("end-to-end", "corpus", name, "images/s", files.size(), [&] { generate_all(&pool); }, 1.0);
+        account(name, &pool);
+    }
+
+    if (failures)
+    {
+        std::cout << "    generate_thumbnail FAILED" << std::endl;
+        ok = false;
+    }
+
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string json, dir;
+    bool keep = false;
+
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg(argv[a]);
+
+        if (arg == "--json" && a + 1 < argc)
+            json = argv[++a];
+        else if (arg == "--corpus" && a + 1 < argc)
+        {
+            dir = argv[++a];
+            keep = true;
+        }
+        else
+        {
+            std::cout << "usage: " << argv[0] << " [--json results.json] [--corpus dir]" << std::endl;
+            return 1;
+        }
+    }
+
+#ifndef __OPTIMIZE__
+    std::cout << "warning: built without optimizations, numbers will be way off" << std::endl;
+#endif
+
+    if (keep)
+        fs::create_directories(dir);
+    else
+    {
+        char tmp[] = "/tmp/swag-corpus-XXXXXX";
+        if (!mkdtemp(tmp))
+        {
+            std::cout << "Could not create a temporary directory: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        dir = tmp;
+    }
+
+    bool ok = bench_resize();
+
+    ok = bench_hash() && ok;
+    ok = bench_keys() && ok;
+
+    std::cout << "writing corpus to " << dir << std::endl;
+    std::vector<std::string> files = Swag::write_corpus(dir, Swag::default_corpus());
+
+    if (files.empty())
+        ok = false;
+    else
+        ok = bench_pipeline(dir, files) && ok;
+
+    if (!keep)
+        fs::remove_all(dir);
+
+    if (!json.empty())
+        ok = write_json(json, ok) && ok;
+
+    return ok ? 0 : 1;
+}
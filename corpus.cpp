@@ -0,0 +1,233 @@
+#include "corpus.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include <jpeglib.h>
+#include <png.h>
+
+#include "resize.h"
+
+namespace Swag
+{
+    std::vector<unsigned char> synthetic_frame(unsigned width, unsigned height, unsigned components, unsigned seed)
+    {
+        std::vector<unsigned char> f((size_t)width * height * components);
+        unsigned state = seed * 2654435761u + 1;
+
+        for (unsigned y = 0; y < height; y++)
+            for (unsigned x = 0; x < width; x++)
+                for (unsigned c = 0; c < components; c++)
+                {
+                    state = state * 1664525u + 1013904223u;
+                    unsigned noise = (state >> 24) & 0x3f;
+                    f[((size_t)y * width + x) * components + c] = (unsigned char)((x * (c + 1) + y * 3 + noise) & 0xff);
+                }
+
+        return f;
+    }
+
+    const std::vector<corpus_spec>& default_corpus()
+    {
+        static const std::vector<corpus_spec> specs = {
+            {"camera-6000x4000-420", false, 6000, 4000, 3, 420, 320},
+            {"camera-4000x3000-422", false, 4000, 3000, 3, 422, 240},
+            {"phone-3024x4032-420", false, 3024, 4032, 3, 420, 320},
+            {"hd-1920x1080-444", false, 1920, 1080, 3, 444, 0},
+            {"gray-3000x2000", false, 3000, 2000, 1, 444, 0},
+            {"web-800x600-420", false, 800, 600, 3, 420, 0},
+            {"png-1920x1080-rgb", true, 1920, 1080, 3, 0, 0},
+            {"png-1024x768-rgba", true, 1024, 768, 4, 0, 0},
+            {"png-1600x1200-gray", true, 1600, 1200, 1, 0, 0},
+        };
+
+        return specs;
+    }
+
+    static void put16(std::vector<unsigned char>& out, unsigned v)
+    {
+        out.push_back(v & 0xff);
+        out.push_back(v >> 8);
+    }
+
+    static void put32(std::vector<unsigned char>& out, uint32_t v)
+    {
+        put16(out, v & 0xffff);
+        put16(out, v >> 16);
+    }
+
+    // APP1 payload the way cameras write it: an Exif header, an empty
+    // IFD0, and an IFD1 pointing at a small JPEG of the same picture
+    static std::vector<unsigned char> exif_block(const corpus_spec& spec, const std::vector<unsigned char>& frame)
+    {
+        unsigned height = spec.preview, width = (unsigned)((double)height * spec.width / spec.height + 0.5);
+        std::vector<unsigned char> small((size_t)width * height * spec.components);
+        std::vector<unsigned char> out = {'E', 'x', 'i', 'f', 0, 0, 'I', 'I', 42, 0};
+        jpeg_compress_struct cinfo;
+        jpeg_error_mgr jerr_mgr;
+        unsigned char* preview = NULL;
+        unsigned long preview_size = 0;
+
+        resize(FILTER_BOX, spec.components, spec.width, spec.height, width, height, frame.data(), small.data());
+
+        cinfo.err = jpeg_std_error(&jerr_mgr);
+        jpeg_create_compress(&cinfo);
+        jpeg_mem_dest(&cinfo, &preview, &preview_size);
+        cinfo.image_width = width;
+        cinfo.image_height = height;
+        cinfo.input_components = spec.components;
+        cinfo.in_color_space = spec.components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+        jpeg_set_defaults(&cinfo);
+        cinfo.write_JFIF_header = FALSE;
+        jpeg_set_quality(&cinfo, 75, TRUE);
+        jpeg_start_compress(&cinfo, TRUE);
+        while (cinfo.next_scanline < cinfo.image_height)
+        {
+            JSAMPROW row = &small[(size_t)cinfo.next_scanline * width * spec.components];
+            jpeg_write_scanlines(&cinfo, &row, 1);
+        }
+        jpeg_finish_compress(&cinfo);
+        jpeg_destroy_compress(&cinfo);
+
+        // offsets count from the TIFF header: IFD0 at 8, IFD1 at 14 with
+        // three entries, then the preview at 56
+        put32(out, 8);
+        put16(out, 0);
+        put32(out, 14);
+        put16(out, 3);
+        put16(out, 0x0103); // compression: jpeg
+        put16(out, 3);
+        put32(out, 1);
+        put32(out, 6);
+        put16(out, 0x0201); // preview offset
+        put16(out, 4);
+        put32(out, 1);
+        put32(out, 56);
+        put16(out, 0x0202); // preview length
+        put16(out, 4);
+        put32(out, 1);
+        put32(out, preview_size);
+        put32(out, 0);
+        out.insert(out.end(), preview, preview + preview_size);
+
+        free(preview);
+        return out;
+    }
+
+    static bool write_jpeg(const std::string& filename, const corpus_spec& spec, const std::vector<unsigned char>& frame)
+    {
+        jpeg_compress_struct cinfo;
+        jpeg_error_mgr jerr_mgr;
+        FILE* f;
+
+        if ((f = fopen(filename.c_str(), "wb")) == NULL)
+        {
+            std::cout << "Could not open " << filename << std::endl;
+            return false;
+        }
+
+        cinfo.err = jpeg_std_error(&jerr_mgr);
+        jerr_mgr.error_exit = [](j_common_ptr cinfo) { throw cinfo->err; };
+        jpeg_create_compress(&cinfo);
+
+        bool ok = true;
+        try
+        {
+            jpeg_stdio_dest(&cinfo, f);
+            cinfo.image_width = spec.width;
+            cinfo.image_height = spec.height;
+            cinfo.input_components = spec.components;
+            cinfo.in_color_space = spec.components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+            jpeg_set_defaults(&cinfo);
+            jpeg_set_quality(&cinfo, 90, TRUE);
+
+            // chroma keeps 1x1, luma sets the mode
+            cinfo.comp_info[0].h_samp_factor = spec.subsampling == 444 ? 1 : 2;
+            cinfo.comp_info[0].v_samp_factor = spec.subsampling == 420 ? 2 : 1;
+
+            jpeg_start_compress(&cinfo, TRUE);
+
+            if (spec.preview)
+            {
+                std::vector<unsigned char> exif = exif_block(spec, frame);
+
+                // one segment holds at most 64k
+                if (exif.size() <= 65533)
+                    jpeg_write_marker(&cinfo, JPEG_APP0 + 1, exif.data(), exif.size());
+                else
+                    std::cout << "Preview of " << filename << " doesn't fit APP1, left out" << std::endl;
+            }
+
+            while (cinfo.next_scanline < cinfo.image_height)
+            {
+                JSAMPROW row = (JSAMPROW)&frame[(size_t)cinfo.next_scanline * spec.width * spec.components];
+                jpeg_write_scanlines(&cinfo, &row, 1);
+            }
+            jpeg_finish_compress(&cinfo);
+        }
+        catch (jpeg_error_mgr*)
+        {
+            std::cout << "Could not write " << filename << std::endl;
+            ok = false;
+        }
+
+        jpeg_destroy_compress(&cinfo);
+        return fclose(f) == 0 && ok;
+    }
+
+    static bool write_png(const std::string& filename, const corpus_spec& spec, const std::vector<unsigned char>& frame)
+    {
+        png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        png_infop info = png ? png_create_info_struct(png) : NULL;
+        FILE* f = NULL;
+        bool ok = false;
+
+        if (info && (f = fopen(filename.c_str(), "wb")) != NULL && !setjmp(png_jmpbuf(png)))
+        {
+            int color = spec.components == 1 ? PNG_COLOR_TYPE_GRAY : spec.components == 4 ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+
+            png_init_io(png, f);
+            // the corpus is written once per run, no need to squeeze it
+            png_set_compression_level(png, 1);
+            png_set_IHDR(png, info, spec.width, spec.height, 8, color, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                         PNG_FILTER_TYPE_DEFAULT);
+            png_write_info(png, info);
+
+            for (unsigned y = 0; y < spec.height; y++)
+                png_write_row(png, (png_bytep)&frame[(size_t)y * spec.width * spec.components]);
+
+            png_write_end(png, NULL);
+            ok = true;
+        }
+
+        png_destroy_write_struct(&png, &info);
+        if (f)
+            ok = fclose(f) == 0 && ok;
+        if (!ok)
+            std::cout << "Could not write " << filename << std::endl;
+        return ok;
+    }
+
+    std::vector<std::string> write_corpus(const std::string& dir, const std::vector<corpus_spec>& specs)
+    {
+        std::vector<std::string> files;
+
+        for (size_t i = 0; i < specs.size(); i++)
+        {
+            const corpus_spec& spec = specs[i];
+            std::vector<unsigned char> frame = synthetic_frame(spec.width, spec.height, spec.components, i + 1);
+            std::string filename = dir + "/" + spec.name + (spec.png ? ".png" : ".jpg");
+
+            if (!(spec.png ? write_png(filename, spec, frame) : write_jpeg(filename, spec, frame)))
+                return std::vector<std::string>();
+
+            files.push_back(filename);
+        }
+
+        return files;
+    }
+} // namespace Swag
@@ -0,0 +1,37 @@
+#ifndef SWAG_CORPUS_H
+#define SWAG_CORPUS_H
+
+#include <string>
+#include <vector>
+
+namespace Swag
+{
+    // deterministic test frame: smooth gradients with a layer of noise, so
+    // resizers and encoders see both flat areas and hard edges
+    std::vector<unsigned char> synthetic_frame(unsigned width, unsigned height, unsigned components, unsigned seed);
+
+    // one synthetic photo. jpegs take 1 or 3 components and a luma
+    // sampling of 444, 422 or 420, and a preview height puts a camera style
+    // Exif preview of that height in APP1; pngs take 1 (gray), 3 (rgb) or 4
+    // (rgba)
+    struct corpus_spec
+    {
+        const char* name;
+        bool png;
+        unsigned width;
+        unsigned height;
+        unsigned components;
+        unsigned subsampling;
+        unsigned preview;
+    };
+
+    // the set swag_bench runs over: camera, phone and web sized jpegs in
+    // every sampling mode, plus a few pngs
+    const std::vector<corpus_spec>& default_corpus();
+
+    // writes every spec as dir/<name>.jpg or .png, the same bytes on
+    // every run. returns the paths in spec order, empty on failure
+    std::vector<std::string> write_corpus(const std::string& dir, const std::vector<corpus_spec>& specs);
+} // namespace Swag
+
+#endif
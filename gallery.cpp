@@ -0,0 +1,405 @@
+#include "gallery.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <queue>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* part_magic = "swag-gallery-part 2";
+
+namespace Swag
+{
+    bool gallery_before(const std::string& a, const std::string& b)
+    {
+        size_t diff = std::mismatch(a.begin(), a.end(), b.begin(), b.end()).first - a.begin();
+
+        if (diff == a.size() && diff == b.size())
+            return false;
+
+        // compare the components both paths are in at the first difference
+        size_t start = diff ? a.rfind('/', diff - 1) + 1 : 0;
+        size_t a_end = a.find('/', start), b_end = b.find('/', start);
+
+        // files before subdirectories
+        if ((a_end == std::string::npos) != (b_end == std::string::npos))
+            return a_end == std::string::npos;
+
+        return a.compare(start, a_end - start, b, start, b_end - start) < 0;
+    }
+
+    static std::string page_filename(const std::string& basepath, unsigned n)
+    {
+        return basepath + "/thumbs/gallery/" + std::to_string(n) + ".js";
+    }
+
+    static FILE* open_page(const std::string& basepath, unsigned n, std::vector<char>& buffer)
+    {
+        std::string filename = page_filename(basepath, n) + ".tmp";
+        FILE* f = fopen(filename.c_str(), "w");
+
+        if (!f)
+        {
+            std::cout << "Could not open " << filename << ": " << strerror(errno) << std::endl;
+            return NULL;
+        }
+
+        setvbuf(f, buffer.data(), _IOFBF, buffer.size());
+        fputs("swag_page([", f);
+        return f;
+    }
+
+    static void put_string(FILE* f, const std::string& s)
+    {
+        fputc('"', f);
+        for (unsigned char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                fputc('\\', f);
+                fputc(c, f);
+            }
+            else if (c < 0x20)
+                fprintf(f, "\\u%04x", c);
+            else
+                fputc(c, f);
+        }
+        fputc('"', f);
+    }
+
+    static void put_entry(FILE* f, const gallery_entry& entry, bool first)
+    {
+        fputs(first ? "\n{\"thumb\": " : ",\n{\"thumb\": ", f);
+        put_string(f, entry.thumb);
+        if (!entry.big.empty())
+        {
+            fputs(", \"big\": ", f);
+            put_string(f, entry.big);
+        }
+        fputs(", \"image\": ", f);
+        put_string(f, entry.image);
+        if (!entry.tiles.empty())
+        {
+            fputs(", \"tiles\": ", f);
+            put_string(f, entry.tiles);
+        }
+        fputc('}', f);
+    }
+
+    static bool close_page(FILE* f, const std::string& basepath, unsigned n)
+    {
+        std::string filename = page_filename(basepath, n);
+
+        fputs("\n]);\n", f);
+        bool written = !ferror(f);
+        written = fclose(f) == 0 && written;
+
+        if (!written || rename((filename + ".tmp").c_str(), filename.c_str()) != 0)
+        {
+            std::cout << "Could not write " << filename << ": " << strerror(errno) << std::endl;
+            unlink((filename + ".tmp").c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // pages from n on, left by a run that had more of them
+    static void remove_pages(const std::string& basepath, unsigned n)
+    {
+        while (unlink(page_filename(basepath, n).c_str()) == 0)
+            n++;
+    }
+
+    static bool write_index(const std::string& basepath, unsigned pages, unsigned page_size, uint64_t images)
+    {
+        std::string filename = basepath + "/gallerydata.js";
+        FILE* f = fopen(filename.c_str(), "w");
+        bool written = false;
+
+        if (f)
+        {
+            fprintf(f, "gallery = {\"pages\": %u, \"page_size\": %u, \"images\": %llu};\n", pages, page_size,
+                    (unsigned long long)images);
+            written = !ferror(f);
+            written = fclose(f) == 0 && written;
+        }
+
+        if (!written)
+        {
+            std::cout << "Could not write " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    gallery_writer::gallery_writer(const std::string& basepath, unsigned page_size)
+        : basepath(basepath), page_size(page_size ? page_size : 1), buffer(1 << 20)
+    {
+        mkdir((basepath + "/thumbs/gallery").c_str(), 0755);
+    }
+
+    gallery_writer::~gallery_writer()
+    {
+        // finish() wasn't reached, don't leave a half page behind
+        if (page)
+        {
+            fclose(page);
+            unlink((page_filename(basepath, page_count) + ".tmp").c_str());
+        }
+    }
+
+    bool gallery_writer::close_page()
+    {
+        bool written = Swag::close_page(page, basepath, page_count);
+
+        page = NULL;
+        page_count++;
+        in_page = 0;
+        return written;
+    }
+
+    void gallery_writer::add(const gallery_entry& entry)
+    {
+        if (!ok)
+            return;
+
+        if (!page && !(ok = (page = open_page(basepath, page_count, buffer)) != NULL))
+            return;
+
+        put_entry(page, entry, in_page == 0);
+
+        images++;
+        if (++in_page == page_size)
+            ok = close_page();
+    }
+
+    bool gallery_writer::finish()
+    {
+        if (page)
+            ok = close_page() && ok;
+
+        remove_pages(basepath, page_count);
+        return write_index(basepath, page_count, page_size, images) && ok;
+    }
+
+    gallery_pages::gallery_pages(const std::string& basepath, unsigned page_size)
+        : basepath(basepath), page_size(page_size ? page_size : 1)
+    {
+        mkdir((basepath + "/thumbs/gallery").c_str(), 0755);
+    }
+
+    unsigned gallery_pages::pages() const
+    {
+        return (entries.size() + page_size - 1) / page_size;
+    }
+
+    void gallery_pages::put(const gallery_entry& entry)
+    {
+        auto at = std::lower_bound(entries.begin(), entries.end(), entry.image,
+                                   [](const gallery_entry& e, const std::string& image) { return gallery_before(e.image, image); });
+        size_t index = at - entries.begin();
+
+        if (at != entries.end() && at->image == entry.image)
+        {
+            if (at->thumb != entry.thumb || at->big != entry.big || at->tiles != entry.tiles)
+            {
+                *at = entry;
+                dirty.insert(index / page_size);
+            }
+            return;
+        }
+
+        entries.insert(at, entry);
+        shifted_from = std::min(shifted_from, index);
+    }
+
+    std::vector<std::string> gallery_pages::prune(const std::string& dir, const std::unordered_set<std::string>& keep)
+    {
+        std::vector<std::string> dropped;
+        size_t out = 0;
+
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            const std::string& image = entries[i].image;
+            bool under = image.compare(0, dir.size(), dir) == 0 && (image.size() == dir.size() || image[dir.size()] == '/');
+
+            if (under && !keep.count(image))
+            {
+                shifted_from = std::min(shifted_from, out);
+                dropped.push_back(image);
+                continue;
+            }
+
+            if (out != i)
+                entries[out] = std::move(entries[i]);
+            out++;
+        }
+
+        entries.resize(out);
+        return dropped;
+    }
+
+    bool gallery_pages::flush()
+    {
+        std::vector<char> buffer(1 << 20);
+        unsigned count = pages();
+        bool ok = true;
+
+        for (unsigned n = shifted_from / page_size; n < count; n++)
+            dirty.insert(n);
+
+        for (unsigned n : dirty)
+        {
+            if (n >= count)
+                continue;
+
+            FILE* f = open_page(basepath, n, buffer);
+            if (!f)
+            {
+                ok = false;
+                continue;
+            }
+
+            size_t end = std::min(entries.size(), (size_t)(n + 1) * page_size);
+            for (size_t i = (size_t)n * page_size; i < end; i++)
+                put_entry(f, entries[i], i == (size_t)n * page_size);
+
+            ok = close_page(f, basepath, n) && ok;
+        }
+
+        if (!index_written || count != written_pages || entries.size() != written_images)
+        {
+            remove_pages(basepath, count);
+            ok = write_index(basepath, count, page_size, entries.size()) && ok;
+            index_written = true;
+        }
+
+        dirty.clear();
+        shifted_from = (size_t)-1;
+        written_pages = count;
+        written_images = entries.size();
+        return ok;
+    }
+
+    gallery_part::gallery_part(const std::string& filename) : filename(filename), buffer(1 << 20)
+    {
+        std::string tmp = filename + ".tmp";
+
+        if (!(part = fopen(tmp.c_str(), "w")))
+        {
+            std::cout << "Could not open " << tmp << ": " << strerror(errno) << std::endl;
+            ok = false;
+            return;
+        }
+
+        setvbuf(part, buffer.data(), _IOFBF, buffer.size());
+        fprintf(part, "%s\n", part_magic);
+    }
+
+    gallery_part::~gallery_part()
+    {
+        if (part)
+        {
+            fclose(part);
+            unlink((filename + ".tmp").c_str());
+        }
+    }
+
+    // thumb \t big \t tiles \t image
+    void gallery_part::add(const gallery_entry& entry)
+    {
+        if (!ok)
+            return;
+
+        fprintf(part, "%s\t%s\t%s\t%s\n", entry.thumb.c_str(), entry.big.c_str(), entry.tiles.c_str(), entry.image.c_str());
+        images++;
+    }
+
+    bool gallery_part::finish()
+    {
+        if (!part)
+            return false;
+
+        bool written = !ferror(part);
+        written = fclose(part) == 0 && written;
+        part = NULL;
+
+        if (!written || rename((filename + ".tmp").c_str(), filename.c_str()) != 0)
+        {
+            std::cout << "Could not write " << filename << ": " << strerror(errno) << std::endl;
+            unlink((filename + ".tmp").c_str());
+            return false;
+        }
+        return ok;
+    }
+
+    // one part being read, its next entry up front
+    struct part_reader
+    {
+        std::ifstream in;
+        gallery_entry next;
+
+        bool advance()
+        {
+            std::string line;
+
+            while (std::getline(in, line))
+            {
+                size_t a = line.find('\t');
+                size_t b = a == std::string::npos ? a : line.find('\t', a + 1);
+                size_t c = b == std::string::npos ? b : line.find('\t', b + 1);
+
+                if (c == std::string::npos)
+                    continue;
+
+                next = gallery_entry{line.substr(0, a), line.substr(a + 1, b - a - 1), line.substr(c + 1),
+                                     line.substr(b + 1, c - b - 1)};
+                return true;
+            }
+            return false;
+        }
+    };
+
+    bool merge_gallery_parts(const std::vector<std::string>& parts, gallery_writer& gallery)
+    {
+        std::vector<std::unique_ptr<part_reader>> readers;
+        auto later = [&](size_t a, size_t b) { return gallery_before(readers[b]->next.image, readers[a]->next.image); };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(later)> queue(later);
+
+        for (auto& filename : parts)
+        {
+            std::string line;
+
+            readers.emplace_back(new part_reader);
+            readers.back()->in.open(filename);
+
+            if (!std::getline(readers.back()->in, line) || line != part_magic)
+            {
+                std::cout << "Could not read " << filename << std::endl;
+                return false;
+            }
+
+            if (readers.back()->advance())
+                queue.push(readers.size() - 1);
+        }
+
+        // every part is in gallery order already, so the smallest of their
+        // next entries is the next one overall
+        while (!queue.empty())
+        {
+            size_t r = queue.top();
+            queue.pop();
+
+            gallery.add(readers[r]->next);
+            if (readers[r]->advance())
+                queue.push(r);
+        }
+
+        return true;
+    }
+} // namespace Swag
@@ -0,0 +1,141 @@
+#ifndef SWAG_GALLERY_H
+#define SWAG_GALLERY_H
+
+#include <cstdint>
+#include <cstdio>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// gallery data, written as one page file per page_size pictures
+//
+// each page file, thumbs/gallery/<n>.js, calls swag_page([...]) with its
+// entries (a script the browser can load from file:// as well), and
+// gallerydata.js only says how many pages and images there are, so
+// index.html?page=n fetches that one page. pages are written next to
+// their final name and renamed into place, a browser never sees half of one.
+//
+// gallery_writer streams a whole run through a buffered writer and never
+// holds more than one entry. gallery_pages keeps every entry in memory for
+// --watch and rewrites only the pages an update touched.
+//
+// a --shard run writes a gallery_part instead: its own entries, one per
+// line and in gallery order. merge_gallery_parts() reads the parts of all
+// shards side by side into a gallery_writer, which then sees the same
+// entries in the same order as a single run would have given it.
+//
+// usage: 1) gallery_writer gallery(basepath, page_size)
+//        2) gallery.add() for every picture, in gallery order
+//        3) gallery.finish() flushes the last page, even a partial one,
+//           writes gallerydata.js and removes pages left from a bigger run
+//
+//        or 1) gallery_pages pages(basepath, page_size)
+//           2) put() and prune() in any order
+//           3) flush() after every batch of changes
+//
+//        or 1) gallery_part part(filename) on every shard, add() and
+//              finish() as with gallery_writer
+//           2) merge_gallery_parts(filenames, gallery) once all are done
+namespace Swag
+{
+    // paths relative to basepath, big is empty when there are no extra sizes
+    // and tiles without --tiles
+    struct gallery_entry
+    {
+        std::string thumb;
+        std::string big;
+        std::string image;
+        std::string tiles; // deep-zoom descriptor
+    };
+
+    // true when image a comes before image b: the files of a directory by
+    // name, then its subdirectories by name, as Scanner reports them
+    bool gallery_before(const std::string& a, const std::string& b);
+
+    class gallery_writer
+    {
+    public:
+        gallery_writer(const std::string& basepath, unsigned page_size);
+        ~gallery_writer();
+
+        gallery_writer(const gallery_writer&) = delete;
+        gallery_writer& operator=(const gallery_writer&) = delete;
+
+        void add(const gallery_entry& entry);
+        bool finish();
+
+        unsigned pages() const { return page_count; }
+
+    private:
+        bool close_page();
+
+        std::string basepath;
+        unsigned page_size;
+        unsigned page_count = 0;
+        unsigned in_page = 0;
+        uint64_t images = 0;
+        FILE* page = NULL;
+        std::vector<char> buffer;
+        bool ok = true;
+    };
+
+    class gallery_pages
+    {
+    public:
+        gallery_pages(const std::string& basepath, unsigned page_size);
+
+        // insert, or replace the entry with the same image
+        void put(const gallery_entry& entry);
+        // drop every entry under dir ("" for all of them, or a single
+        // image) that isn't in keep; returns the images dropped
+        std::vector<std::string> prune(const std::string& dir, const std::unordered_set<std::string>& keep);
+
+        // write the pages that changed since the last flush, and the index
+        // when the page or image count did
+        bool flush();
+
+        unsigned pages() const;
+        size_t size() const { return entries.size(); }
+
+    private:
+        std::string basepath;
+        unsigned page_size;
+        std::vector<gallery_entry> entries;
+        // pages with a replaced entry, and where inserts and removals
+        // started shifting every page after them
+        std::set<unsigned> dirty;
+        size_t shifted_from = 0;
+        unsigned written_pages = 0;
+        uint64_t written_images = 0;
+        bool index_written = false;
+    };
+
+    class gallery_part
+    {
+    public:
+        explicit gallery_part(const std::string& filename);
+        ~gallery_part();
+
+        gallery_part(const gallery_part&) = delete;
+        gallery_part& operator=(const gallery_part&) = delete;
+
+        void add(const gallery_entry& entry);
+        bool finish();
+
+        uint64_t size() const { return images; }
+
+    private:
+        std::string filename;
+        uint64_t images = 0;
+        FILE* part = NULL;
+        std::vector<char> buffer;
+        bool ok = true;
+    };
+
+    // add the entries of every part to gallery in gallery order; false when
+    // a part can't be read
+    bool merge_gallery_parts(const std::vector<std::string>& parts, gallery_writer& gallery);
+} // namespace Swag
+
+#endif
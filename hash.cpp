@@ -0,0 +1,584 @@
+#include "hash.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "md5.h"
+
+#ifdef SWAG_X86
+  #include <immintrin.h>
+#endif
+
+namespace Swag
+{
+    bool parse_hash(const std::string& name, hash_kind& kind)
+    {
+        static const hash_kind kinds[] = {HASH_MD5, HASH_FAST64, HASH_FAST128};
+
+        for (hash_kind k : kinds)
+        {
+            if (name == hash_name(k))
+            {
+                kind = k;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char* hash_name(hash_kind kind)
+    {
+        switch (kind)
+        {
+        case HASH_FAST64:
+            return "fast64";
+        case HASH_FAST128:
+            return "fast128";
+        default:
+            return "md5";
+        }
+    }
+
+    // fast_hash
+
+    // per-lane keys: stripe n of a block uses stripe_keys[n..n+7], the
+    // scramble at the end of every 16 stripe block uses the last eight
+    static const uint64_t stripe_keys[24] = {
+        0x62051498fb777520ULL, 0x526b2cac9afb4c12ULL, 0x308f919b8bd76a33ULL, 0xb4bd880d86018cf1ULL,
+        0xaee84177cbb7e864ULL, 0x831fc1bed86d2917ULL, 0xf6aaf73bf4f20b95ULL, 0xeb66270048fc5bbbULL,
+        0xeeef5f47a63e9f0bULL, 0x7df8429b7c4c4903ULL, 0x13370d0dc6cdc801ULL, 0x76d029de02156d4bULL,
+        0xbb9a591d2cc4dac7ULL, 0x4b689635adad3592ULL, 0x37a9041c30f1c10aULL, 0x212c8fcb92ac4bdeULL,
+        0xbcfc77bacf2ac449ULL, 0x06fc637f10f80a78ULL, 0x499700af240a1b78ULL, 0xa34ff1b121444ccbULL,
+        0xc0c800624aabc3eaULL, 0x9d736aea1472eb37ULL, 0xe3652e7c87265c10ULL, 0xc0f26ca760a68660ULL,
+    };
+
+    static const unsigned stripes_per_block = 16;
+    static const uint64_t prime32 = 0x9E3779B1u;
+
+    static inline uint64_t read64(const unsigned char* p)
+    {
+        uint64_t v = 0;
+
+        for (int i = 7; i >= 0; i--)
+            v = (v << 8) | p[i];
+        return v;
+    }
+
+    // full 64x64 bit product, both halves xor'ed together
+    static inline uint64_t fold64(uint64_t a, uint64_t b)
+    {
+#ifdef __SIZEOF_INT128__
+        unsigned __int128 m = (unsigned __int128)a * b;
+        return (uint64_t)m ^ (uint64_t)(m >> 64);
+#else
+        uint64_t lo_lo = (a & 0xffffffff) * (b & 0xffffffff);
+        uint64_t hi_lo = (a >> 32) * (b & 0xffffffff);
+        uint64_t lo_hi = (a & 0xffffffff) * (b >> 32);
+        uint64_t hi_hi = (a >> 32) * (b >> 32);
+        uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffff) + lo_hi;
+        uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+        return ((cross << 32) | (lo_lo & 0xffffffff)) ^ upper;
+#endif
+    }
+
+    static inline uint64_t avalanche(uint64_t h)
+    {
+        h ^= h >> 37;
+        h *= 0x165667919E3779F9ULL;
+        return h ^ (h >> 32);
+    }
+
+    // each lane adds the product of the two halves of its keyed input, and
+    // the raw input of its neighbour so no input bit is lost to a zero half
+    static void accumulate_scalar(uint64_t* acc, const unsigned char* p, size_t stripes, unsigned& stripe)
+    {
+        for (size_t s = 0; s < stripes; s++, p += 64)
+        {
+            const uint64_t* key = stripe_keys + stripe;
+
+            for (unsigned i = 0; i < 8; i++)
+            {
+                uint64_t d = read64(p + 8 * i);
+                uint64_t k = d ^ key[i];
+
+                acc[i ^ 1] += d;
+                acc[i] += (k & 0xffffffff) * (k >> 32);
+            }
+
+            if (++stripe == stripes_per_block)
+            {
+                for (unsigned i = 0; i < 8; i++)
+                {
+                    acc[i] ^= acc[i] >> 47;
+                    acc[i] ^= stripe_keys[16 + i];
+                    acc[i] *= prime32;
+                }
+                stripe = 0;
+            }
+        }
+    }
+
+#ifdef SWAG_X86
+    static void accumulate_sse2(uint64_t* acc, const unsigned char* p, size_t stripes, unsigned& stripe)
+    {
+        const __m128i prime = _mm_set1_epi32((int)prime32);
+        __m128i a[4];
+
+        for (unsigned j = 0; j < 4; j++)
+            a[j] = _mm_loadu_si128((const __m128i*)(acc + 2 * j));
+
+        for (size_t s = 0; s < stripes; s++, p += 64)
+        {
+            const uint64_t* key = stripe_keys + stripe;
+
+            for (unsigned j = 0; j < 4; j++)
+            {
+                __m128i d = _mm_loadu_si128((const __m128i*)(p + 16 * j));
+                __m128i k = _mm_xor_si128(d, _mm_loadu_si128((const __m128i*)(key + 2 * j)));
+                __m128i product = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+
+                a[j] = _mm_add_epi64(a[j], _mm_add_epi64(product, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2))));
+            }
+
+            if (++stripe == stripes_per_block)
+            {
+                for (unsigned j = 0; j < 4; j++)
+                {
+                    __m128i x = _mm_xor_si128(a[j], _mm_srli_epi64(a[j], 47));
+                    x = _mm_xor_si128(x, _mm_loadu_si128((const __m128i*)(stripe_keys + 16 + 2 * j)));
+
+                    // 64x32 bit multiply out of two 32x32 ones
+                    __m128i lo = _mm_mul_epu32(x, prime);
+                    __m128i hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+                    a[j] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+                }
+                stripe = 0;
+            }
+        }
+
+        for (unsigned j = 0; j < 4; j++)
+            _mm_storeu_si128((__m128i*)(acc + 2 * j), a[j]);
+    }
+
+    __attribute__((target("avx2")))
+    static void accumulate_avx2(uint64_t* acc, const unsigned char* p, size_t stripes, unsigned& stripe)
+    {
+        const __m256i prime = _mm256_set1_epi32((int)prime32);
+        __m256i a[2];
+
+        for (unsigned j = 0; j < 2; j++)
+            a[j] = _mm256_loadu_si256((const __m256i*)(acc + 4 * j));
+
+        for (size_t s = 0; s < stripes; s++, p += 64)
+        {
+            const uint64_t* key = stripe_keys + stripe;
+
+            for (unsigned j = 0; j < 2; j++)
+            {
+                __m256i d = _mm256_loadu_si256((const __m256i*)(p + 32 * j));
+                __m256i k = _mm256_xor_si256(d, _mm256_loadu_si256((const __m256i*)(key + 4 * j)));
+                __m256i product = _mm256_mul_epu32(k, _mm256_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+
+                a[j] = _mm256_add_epi64(a[j], _mm256_add_epi64(product, _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2))));
+            }
+
+            if (++stripe == stripes_per_block)
+            {
+                for (unsigned j = 0; j < 2; j++)
+                {
+                    __m256i x = _mm256_xor_si256(a[j], _mm256_srli_epi64(a[j], 47));
+                    x = _mm256_xor_si256(x, _mm256_loadu_si256((const __m256i*)(stripe_keys + 16 + 4 * j)));
+
+                    __m256i lo = _mm256_mul_epu32(x, prime);
+                    __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime);
+                    a[j] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+                }
+                stripe = 0;
+            }
+        }
+
+        for (unsigned j = 0; j < 2; j++)
+            _mm256_storeu_si256((__m256i*)(acc + 4 * j), a[j]);
+    }
+#endif
+
+    static void accumulate(simd_level level, uint64_t* acc, const unsigned char* p, size_t stripes, unsigned& stripe)
+    {
+        switch (level)
+        {
+#ifdef SWAG_X86
+        case SIMD_AVX2:
+            accumulate_avx2(acc, p, stripes, stripe);
+            break;
+        case SIMD_SSE2:
+            accumulate_sse2(acc, p, stripes, stripe);
+            break;
+#endif
+        default:
+            accumulate_scalar(acc, p, stripes, stripe);
+            break;
+        }
+    }
+
+    fast_hash::fast_hash() : fast_hash(detect_simd())
+    {
+    }
+
+    fast_hash::fast_hash(simd_level level)
+        : level(level),
+          acc{0xC2B2AE3DULL, 0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x85EBCA77C2B2AE63ULL,
+              0x85EBCA77ULL, 0x27D4EB2F165667C5ULL, 0x9E3779B1ULL},
+          stripe(0), buffered(0), length(0)
+    {
+    }
+
+    void fast_hash::update(const unsigned char* p, size_t size)
+    {
+        length += size;
+
+        if (buffered)
+        {
+            size_t n = std::min(size, (size_t)(sizeof(buffer) - buffered));
+
+            memcpy(buffer + buffered, p, n);
+            buffered += n;
+            p += n;
+            size -= n;
+
+            if (buffered < sizeof(buffer))
+                return;
+
+            accumulate(level, acc, buffer, 1, stripe);
+            buffered = 0;
+        }
+
+        size_t stripes = size / 64;
+        accumulate(level, acc, p, stripes, stripe);
+
+        buffered = size - stripes * 64;
+        memcpy(buffer, p + stripes * 64, buffered);
+    }
+
+    void fast_hash::digest(uint64_t& low, uint64_t& high) const
+    {
+        uint64_t a[8];
+        unsigned s = stripe;
+
+        memcpy(a, acc, sizeof(a));
+
+        // the tail goes in zero padded, the length tells it apart
+        if (buffered)
+        {
+            unsigned char last[64] = {0};
+
+            memcpy(last, buffer, buffered);
+            accumulate_scalar(a, last, 1, s);
+        }
+
+        low = length * 0x9E3779B185EBCA87ULL;
+        high = ~length * 0xC2B2AE3D27D4EB4FULL;
+        for (unsigned i = 0; i < 4; i++)
+        {
+            low += fold64(a[2 * i] ^ stripe_keys[2 * i], a[2 * i + 1] ^ stripe_keys[2 * i + 1]);
+            high += fold64(a[2 * i] ^ stripe_keys[8 + 2 * i], a[2 * i + 1] ^ stripe_keys[9 + 2 * i]);
+        }
+
+        low = avalanche(low);
+        high = avalanche(high);
+    }
+
+    // hasher front ends
+
+    class md5_hasher : public hasher
+    {
+    public:
+        void update(const unsigned char* p, size_t size) override { md5.update(p, size); }
+        std::string hexdigest() override { return md5.finalize().hexdigest(); }
+
+    private:
+        MD5 md5;
+    };
+
+    class fast_hasher : public hasher
+    {
+    public:
+        explicit fast_hasher(bool wide) : wide(wide) {}
+
+        void update(const unsigned char* p, size_t size) override { hash.update(p, size); }
+        std::string hexdigest() override
+        {
+            uint64_t low, high;
+            char buf[33];
+
+            hash.digest(low, high);
+            if (wide)
+                snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)low, (unsigned long long)high);
+            else
+                snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)low);
+            return buf;
+        }
+
+    private:
+        bool wide;
+        fast_hash hash;
+    };
+
+    std::unique_ptr<hasher> make_hasher(hash_kind kind)
+    {
+        switch (kind)
+        {
+        case HASH_FAST64:
+            return std::unique_ptr<hasher>(new fast_hasher(false));
+        case HASH_FAST128:
+            return std::unique_ptr<hasher>(new fast_hasher(true));
+        default:
+            return std::unique_ptr<hasher>(new md5_hasher());
+        }
+    }
+
+    std::string hash_string(hash_kind kind, const std::string& text)
+    {
+        std::unique_ptr<hasher> h = make_hasher(kind);
+
+        h->update((const unsigned char*)text.data(), text.size());
+        return h->hexdigest();
+    }
+
+    // multi-buffer md5
+
+    typedef uint32_t u32x4 __attribute__((vector_size(16)));
+    typedef uint32_t u32x8 __attribute__((vector_size(32)));
+
+    static const uint32_t md5_sines[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+
+    static const unsigned md5_shifts[4][4] = {{7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+
+    // one RFC 1321 block transform, written once for plain words and for
+    // vectors of lanes. always inlined so every caller gets code for its
+    // own instruction set
+    template <typename V>
+    static inline __attribute__((always_inline)) void md5_lanes(V* state, const V* w)
+    {
+        V a = state[0], b = state[1], c = state[2], d = state[3];
+
+#define SWAG_MD5_STEP(f, g)                                      \
+    {                                                            \
+        V t = a + (f) + w[g] + md5_sines[i];                     \
+        unsigned s = md5_shifts[i / 16][i % 4];                  \
+        a = d;                                                   \
+        d = c;                                                   \
+        c = b;                                                   \
+        b = b + ((t << s) | (t >> (32 - s)));                    \
+    }
+
+#pragma GCC unroll 16
+        for (unsigned i = 0; i < 16; i++)
+            SWAG_MD5_STEP(d ^ (b & (c ^ d)), i);
+#pragma GCC unroll 16
+        for (unsigned i = 16; i < 32; i++)
+            SWAG_MD5_STEP(c ^ (d & (b ^ c)), (5 * i + 1) % 16);
+#pragma GCC unroll 16
+        for (unsigned i = 32; i < 48; i++)
+            SWAG_MD5_STEP(b ^ c ^ d, (3 * i + 5) % 16);
+#pragma GCC unroll 16
+        for (unsigned i = 48; i < 64; i++)
+            SWAG_MD5_STEP(c ^ (b | ~d), (7 * i) % 16);
+
+#undef SWAG_MD5_STEP
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+
+    template <typename V, unsigned L>
+    static inline __attribute__((always_inline)) void md5_blocks(uint32_t state[4][L], const uint32_t w[16][L])
+    {
+        V s[4], x[16];
+
+        memcpy(s, state, sizeof(s));
+        memcpy(x, w, sizeof(x));
+        md5_lanes(s, x);
+        memcpy(state, s, sizeof(s));
+    }
+
+    static void md5_blocks_scalar(uint32_t state[4][1], const uint32_t w[16][1])
+    {
+        md5_blocks<uint32_t, 1>(state, w);
+    }
+
+#ifdef SWAG_X86
+    static void md5_blocks_sse2(uint32_t state[4][4], const uint32_t w[16][4])
+    {
+        md5_blocks<u32x4, 4>(state, w);
+    }
+
+    __attribute__((target("avx2")))
+    static void md5_blocks_avx2(uint32_t state[4][8], const uint32_t w[16][8])
+    {
+        md5_blocks<u32x8, 8>(state, w);
+    }
+#endif
+
+    // feeds L lanes one block each per transform. every message ends in
+    // one or two padded blocks built up front, the rest is read in place
+    template <unsigned L>
+    static void md5_schedule(const unsigned char* const data[], const size_t sizes[], size_t count, std::string digests[],
+                             void (*blocks)(uint32_t state[4][L], const uint32_t w[16][L]))
+    {
+        struct lane
+        {
+            bool busy;
+            size_t message;
+            size_t block;
+            size_t full;
+            size_t blocks;
+            unsigned char tail[128];
+        };
+
+        static const unsigned char idle[64] = {0};
+        lane lanes[L];
+        uint32_t state[4][L];
+        uint32_t w[16][L];
+        size_t next = 0;
+
+        auto start = [&](unsigned l) {
+            lane& ln = lanes[l];
+
+            ln.busy = next < count;
+            if (!ln.busy)
+                return;
+
+            ln.message = next++;
+            ln.block = 0;
+            ln.full = sizes[ln.message] / 64;
+
+            size_t rest = sizes[ln.message] % 64;
+            uint64_t bits = (uint64_t)sizes[ln.message] * 8;
+
+            ln.blocks = ln.full + (rest < 56 ? 1 : 2);
+            memset(ln.tail, 0, sizeof(ln.tail));
+            if (rest)
+                memcpy(ln.tail, data[ln.message] + ln.full * 64, rest);
+            ln.tail[rest] = 0x80;
+
+            unsigned char* end = ln.tail + (ln.blocks - ln.full) * 64 - 8;
+            for (unsigned i = 0; i < 8; i++)
+                end[i] = (unsigned char)(bits >> (8 * i));
+
+            state[0][l] = 0x67452301;
+            state[1][l] = 0xefcdab89;
+            state[2][l] = 0x98badcfe;
+            state[3][l] = 0x10325476;
+        };
+
+        auto block_of = [&](const lane& ln) {
+            return ln.block < ln.full ? data[ln.message] + ln.block * 64 : ln.tail + (ln.block - ln.full) * 64;
+        };
+
+        auto load = [](uint32_t* words, size_t stride, const unsigned char* p) {
+            for (unsigned j = 0; j < 16; j++)
+                words[j * stride] = p[4 * j] | (p[4 * j + 1] << 8) | (p[4 * j + 2] << 16) | ((uint32_t)p[4 * j + 3] << 24);
+        };
+
+        auto finish = [&](unsigned l, const uint32_t* words, size_t stride) {
+            char hex[33];
+            for (unsigned i = 0; i < 16; i++)
+                snprintf(hex + 2 * i, 3, "%02x", (words[i / 4 * stride] >> (8 * (i % 4))) & 0xff);
+            digests[lanes[l].message] = hex;
+        };
+
+        for (unsigned l = 0; l < L; l++)
+            start(l);
+
+        for (;;)
+        {
+            unsigned busy = 0;
+
+            for (unsigned l = 0; l < L; l++)
+            {
+                const lane& ln = lanes[l];
+
+                if (ln.busy)
+                    busy++;
+                load(&w[0][l], L, ln.busy ? block_of(ln) : idle);
+            }
+
+            // with nothing left to start, a few long messages would keep
+            // the other lanes idle, and one lane of a vector runs well
+            // below the scalar transform: finish them one at a time
+            if (L > 1 && next == count && busy * 2 < L)
+            {
+                for (unsigned l = 0; l < L; l++)
+                {
+                    lane& ln = lanes[l];
+                    uint32_t one[4][1] = {{state[0][l]}, {state[1][l]}, {state[2][l]}, {state[3][l]}};
+                    uint32_t words[16][1];
+
+                    if (!ln.busy)
+                        continue;
+
+                    for (; ln.block < ln.blocks; ln.block++)
+                    {
+                        load(&words[0][0], 1, block_of(ln));
+                        md5_blocks_scalar(one, words);
+                    }
+                    finish(l, &one[0][0], 1);
+                }
+                break;
+            }
+
+            if (!busy)
+                break;
+
+            blocks(state, w);
+
+            for (unsigned l = 0; l < L; l++)
+            {
+                lane& ln = lanes[l];
+
+                if (!ln.busy || ++ln.block < ln.blocks)
+                    continue;
+
+                finish(l, &state[0][l], L);
+                start(l);
+            }
+        }
+    }
+
+    void md5_many(const unsigned char* const data[], const size_t sizes[], size_t count, std::string digests[], simd_level level)
+    {
+        switch (level)
+        {
+#ifdef SWAG_X86
+        case SIMD_AVX2:
+            md5_schedule<8>(data, sizes, count, digests, md5_blocks_avx2);
+            break;
+        case SIMD_SSE2:
+            md5_schedule<4>(data, sizes, count, digests, md5_blocks_sse2);
+            break;
+#endif
+        default:
+            md5_schedule<1>(data, sizes, count, digests, md5_blocks_scalar);
+            break;
+        }
+    }
+
+    void md5_many(const unsigned char* const data[], const size_t sizes[], size_t count, std::string digests[])
+    {
+        static const simd_level level = detect_simd();
+
+        md5_many(data, sizes, count, digests, level);
+    }
+} // namespace Swag
@@ -0,0 +1,76 @@
+#ifndef SWAG_HASH_H
+#define SWAG_HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "simd.h"
+
+namespace Swag
+{
+    enum hash_kind
+    {
+        HASH_MD5,
+        HASH_FAST64,
+        HASH_FAST128
+    };
+
+    // "md5", "fast64" or "fast128"
+    bool parse_hash(const std::string& name, hash_kind& kind);
+    const char* hash_name(hash_kind kind);
+
+    // incremental hash of a byte stream
+    //
+    // usage: 1) make_hasher(kind)
+    //        2) feed it with update()
+    //        3) hexdigest() once, the hasher is spent afterwards
+    class hasher
+    {
+    public:
+        virtual ~hasher() {}
+        virtual void update(const unsigned char* p, size_t size) = 0;
+        virtual std::string hexdigest() = 0;
+    };
+
+    std::unique_ptr<hasher> make_hasher(hash_kind kind);
+
+    // hexdigest of a whole string in one go
+    std::string hash_string(hash_kind kind, const std::string& text);
+
+    // non-cryptographic 128 bit hash, built for bulk file contents. input
+    // goes through eight 64 bit lanes in 64 byte stripes, one multiply per
+    // lane and stripe, which maps onto SSE2/AVX2 directly. every level
+    // gives the same digest
+    class fast_hash
+    {
+    public:
+        fast_hash();
+        explicit fast_hash(simd_level level);
+
+        void update(const unsigned char* p, size_t size);
+
+        // low and high 64 bits; the low half is the 64 bit variant
+        void digest(uint64_t& low, uint64_t& high) const;
+
+    private:
+        simd_level level;
+        uint64_t acc[8];
+        unsigned stripe;
+        unsigned buffered;
+        uint64_t length;
+        unsigned char buffer[64];
+    };
+
+    // multi-buffer MD5: count independent messages are hashed side by side,
+    // one per 32 bit lane (4 with SSE2, 8 with AVX2). a lane picks up the
+    // next message as soon as its own is done, and once fewer than half
+    // the lanes have work left the rest finish on the scalar transform, so
+    // sizes may differ freely. digests match MD5::hexdigest(). md5 content
+    // keys go through it a batch of files at a time
+    void md5_many(const unsigned char* const data[], const size_t sizes[], size_t count, std::string digests[]);
+    void md5_many(const unsigned char* const data[], const size_t sizes[], size_t count, std::string digests[], simd_level level);
+} // namespace Swag
+
+#endif
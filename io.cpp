@@ -0,0 +1,252 @@
+#include "io.h"
+
+#include "stats.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Swag
+{
+    bool input_file::open(const std::string& filename, bool map)
+    {
+        stage_timer timer(STAGE_OPEN);
+
+        close();
+
+        if (map)
+        {
+            int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+
+            if (fd < 0)
+            {
+                std::cout << "can't open " << filename << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+
+            if (fstat(fd, &st) == 0 && st.st_size > 0)
+            {
+                void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+                if (p != MAP_FAILED)
+                {
+                    // the decoder reads front to back exactly once
+                    madvise(p, st.st_size, MADV_SEQUENTIAL);
+                    data = (const unsigned char*)p;
+                    size = st.st_size;
+                    stats_bytes_read(size);
+                }
+            }
+
+            // the mapping keeps its own reference to the file
+            ::close(fd);
+
+            if (data)
+                return true;
+        }
+
+        if ((file = fopen(filename.c_str(), "rb")) == NULL)
+        {
+            std::cout << "can't fopen " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        if (stats_enabled)
+        {
+            struct stat st;
+            if (fstat(fileno(file), &st) == 0)
+                stats_bytes_read(st.st_size);
+        }
+
+        return true;
+    }
+
+    void input_file::borrow(const unsigned char* data, size_t size)
+    {
+        close();
+        this->data = data;
+        this->size = size;
+        borrowed = true;
+    }
+
+    void input_file::close()
+    {
+        if (data && !borrowed)
+            munmap((void*)data, size);
+        if (file)
+            fclose(file);
+
+        data = NULL;
+        size = 0;
+        file = NULL;
+        borrowed = false;
+    }
+
+    output_buffer::~output_buffer()
+    {
+        free(data);
+    }
+
+    void output_buffer::adopt(unsigned char* block, unsigned long used)
+    {
+        if (block == data)
+            return;
+
+        free(data);
+        data = block;
+        capacity = used;
+    }
+
+    unsigned char* scratch_space::get(scratch_slot slot, size_t size)
+    {
+        output_buffer& b = slots[slot];
+
+        // half again each time, so a run of slightly bigger images doesn't
+        // reallocate on every one
+        if (size > b.capacity)
+        {
+            free(b.data);
+            b.capacity = std::max<size_t>(size, b.capacity + b.capacity / 2);
+            if ((b.data = (unsigned char*)malloc(b.capacity)) == NULL)
+                b.capacity = 0;
+        }
+
+        return b.data;
+    }
+
+    size_t scratch_space::growth(scratch_slot slot, size_t size) const
+    {
+        const output_buffer& b = slots[slot];
+
+        if (size <= b.capacity)
+            return 0;
+        return std::max<size_t>(size, b.capacity + b.capacity / 2) - b.capacity;
+    }
+
+    size_t scratch_space::release(scratch_slot slot)
+    {
+        output_buffer& b = slots[slot];
+        size_t capacity = b.capacity;
+
+        free(b.data);
+        b.data = NULL;
+        b.capacity = 0;
+        return capacity;
+    }
+
+    memory_budget::memory_budget(size_t limit, unsigned workers) : bytes(limit), workers(std::max(1u, workers))
+    {
+    }
+
+    // request fits on top of what is reserved and held; a job that would
+    // be the only one holding memory goes whatever it asks for, or it
+    // could never run
+    bool memory_budget::fits(size_t request) const
+    {
+        return busy + held + request <= bytes || busy == 0;
+    }
+
+    bool memory_budget::try_reserve(size_t bytes)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        // no exception for a job on its own, it has somewhere else to go
+        if (busy + held + bytes > this->bytes)
+            return false;
+
+        busy += bytes;
+        return true;
+    }
+
+    void memory_budget::reserve(size_t bytes, size_t mine)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+
+        // a waiting job gives back what it already has and takes it back
+        // together with the rest, so two jobs that each hold a part never
+        // wait for each other
+        if (!fits(bytes) && busy != mine)
+        {
+            stage_timer timer(STAGE_WAIT);
+
+            busy -= mine;
+            freed.notify_all();
+            freed.wait(guard, [&] { return fits(mine + bytes); });
+            busy += mine;
+        }
+
+        busy += bytes;
+    }
+
+    void memory_budget::finish(size_t reserved, ptrdiff_t kept)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            busy -= reserved;
+            held += kept;
+        }
+
+        freed.notify_all();
+    }
+
+    bool make_parent_dirs(const std::string& filename)
+    {
+        for (size_t slash = filename.find('/', 1); slash != std::string::npos; slash = filename.find('/', slash + 1))
+            if (mkdir(filename.substr(0, slash).c_str(), 0755) != 0 && errno != EEXIST)
+                return false;
+        return true;
+    }
+
+    bool remove_tree(const std::string& path)
+    {
+        auto remove_entry = [](const char* name, const struct stat*, int, struct FTW*) { return remove(name); };
+
+        return nftw(path.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS) == 0 || errno == ENOENT;
+    }
+
+    bool write_file(const std::string& filename, const unsigned char* data, size_t size)
+    {
+        int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        // first thumbnail in a fan-out directory
+        if (fd < 0 && errno == ENOENT && make_parent_dirs(filename))
+            fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+        if (fd < 0)
+        {
+            std::cout << "Could not open " << filename << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        // regular files take it in one go, the loop only covers signals
+        while (size > 0)
+        {
+            ssize_t n = ::write(fd, data, size);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n <= 0)
+            {
+                std::cout << "Could not write " << filename << ": " << strerror(errno) << std::endl;
+                ::close(fd);
+                unlink(filename.c_str());
+                return false;
+            }
+
+            data += n;
+            size -= n;
+        }
+
+        return ::close(fd) == 0;
+    }
+} // namespace Swag
@@ -0,0 +1,137 @@
+#ifndef SWAG_IO_H
+#define SWAG_IO_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+namespace Swag
+{
+    // a source file, either mapped read-only into memory (data/size) or
+    // opened through stdio (file)
+    struct input_file
+    {
+        FILE* file = NULL;
+        const unsigned char* data = NULL;
+        size_t size = 0;
+        bool borrowed = false;
+
+        input_file() = default;
+        input_file(const input_file&) = delete;
+        input_file& operator=(const input_file&) = delete;
+        ~input_file() { close(); }
+
+        // map asks for mmap + MADV_SEQUENTIAL; empty files fall back to stdio
+        bool open(const std::string& filename, bool map);
+        // read from the caller's memory instead, which close() leaves alone
+        void borrow(const unsigned char* data, size_t size);
+        void close();
+    };
+
+    // malloc'd scratch buffer that is kept and only ever grows, so encoding
+    // thumbnails into memory doesn't allocate once it is warm
+    struct output_buffer
+    {
+        unsigned char* data = NULL;
+        unsigned long capacity = 0;
+
+        output_buffer() = default;
+        output_buffer(output_buffer&& other) : data(other.data), capacity(other.capacity)
+        {
+            other.data = NULL;
+            other.capacity = 0;
+        }
+        output_buffer(const output_buffer&) = delete;
+        output_buffer& operator=(const output_buffer&) = delete;
+        ~output_buffer();
+
+        // take over a block the encoder allocated itself once ours got too
+        // small; used bytes is all we know of its capacity
+        void adopt(unsigned char* block, unsigned long used);
+    };
+
+    // scratch memory for decoded frames and resize targets, one set per
+    // worker thread (or library caller). each slot keeps one buffer that
+    // grows to the largest image it has seen and is never handed back, so
+    // a warm worker neither allocates nor faults pages in for pixels.
+    // contents don't survive growing
+    enum scratch_slot
+    {
+        SCRATCH_FRAME,      // decoded frame, img->data
+        SCRATCH_RESIZE,     // resize targets, one size after another
+        SCRATCH_RESIZE_ALT,
+        SCRATCH_ROWS,       // decoder rows (whole frame for interlaced png)
+        SCRATCH_BLEND,      // alpha compositing
+        SCRATCH_HEAD,       // start of a stdio source, for --exif
+        SCRATCH_COUNT
+    };
+
+    struct scratch_space
+    {
+        output_buffer slots[SCRATCH_COUNT];
+
+        // at least size bytes of the buffer for slot
+        unsigned char* get(scratch_slot slot, size_t size);
+        // bytes get(slot, size) would add to the buffer, 0 when it fits
+        size_t growth(scratch_slot slot, size_t size) const;
+        // hand the buffer back, returning what it held
+        size_t release(scratch_slot slot);
+    };
+
+    // memory that decodes on every thread are admitted against, see
+    // --mem-limit. a job reserves what it is about to allocate once the
+    // picture's header says how large it is and returns it when it is done;
+    // scratch kept warm between jobs stays charged as held. a reservation
+    // that doesn't fit waits for running jobs to finish, handing back what
+    // the same job reserved earlier until all of it fits again, and one
+    // larger than the whole budget is let through once no other job holds
+    // any
+    //
+    // usage: 1) memory_budget budget(bytes, workers), outliving the workers
+    //        2) reserve() before allocating, passing what the same job
+    //           already has reserved, or try_reserve() when there is a
+    //           cheaper way to do it should that fail
+    //        3) finish() when the job ends
+    class memory_budget
+    {
+    public:
+        memory_budget(size_t limit, unsigned workers);
+
+        // take bytes if they fit under the limit right now
+        bool try_reserve(size_t bytes);
+        // take bytes, waiting until they fit next to what no other job
+        // holds; mine is what the caller reserved before and still has
+        void reserve(size_t bytes, size_t mine);
+        // a job done: its reservation goes, and held changes by kept
+        // (negative for scratch that was given back)
+        void finish(size_t reserved, ptrdiff_t kept);
+
+        size_t limit() const { return bytes; }
+        // scratch one worker may keep warm between jobs
+        size_t keep() const { return bytes / (2 * workers); }
+
+    private:
+        bool fits(size_t request) const;
+
+        std::mutex lock;
+        std::condition_variable freed;
+        size_t bytes;
+        unsigned workers;
+        size_t busy = 0; // reserved by running jobs
+        size_t held = 0; // scratch kept between jobs
+    };
+
+    // create or truncate filename and write size bytes with a single write();
+    // missing parent directories are created
+    bool write_file(const std::string& filename, const unsigned char* data, size_t size);
+
+    // create the directories leading up to filename, like mkdir -p
+    bool make_parent_dirs(const std::string& filename);
+
+    // path and everything under it, like rm -r; a missing path is fine
+    bool remove_tree(const std::string& path);
+} // namespace Swag
+
+#endif
@@ -1,15 +1,30 @@
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <vector>
 #include <string>
-
-#include <jpeglib.h>
-#include <math.h>
-#include <memory.h>
-#include <png.h>
-
-#include "md5.h"
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gallery.h"
+#include "hash.h"
+#include "io.h"
+#include "manifest.h"
+#include "pool.h"
+#include "resize.h"
+#include "scan.h"
+#include "serve.h"
+#include "stats.h"
+#include "thumbnail.h"
+#include "watch.h"
 
 #if __has_include(<filesystem>)
   #include <filesystem>
@@ -21,7 +36,13 @@
   error "Missing the <filesystem> header."
 #endif
 
-int def_scaleheight = 200;
+bool def_content_keys = false;
+bool def_tiles = false;
+Swag::hash_kind def_hash = Swag::HASH_MD5;
+
+// behind def_budget; outlives every worker's workspace, the main thread's
+// included
+static std::unique_ptr<Swag::memory_budget> mem_budget;
 
 // <script>
 // var data = [
@@ -62,21 +83,40 @@ std::string html = R"html(<!doctype html>
         <script src="https://cdnjs.cloudflare.com/ajax/libs/galleria/1.6.1/galleria.min.js"></script>
         <script src="gallerydata.js"></script>
         <script>
-            $(function() {
-                var url = new URL(window.location.href);
-                var c = url.searchParams.get("page");
-                if(c == null) c = 0;
-
-                Galleria.loadTheme('https://cdnjs.cloudflare.com/ajax/libs/galleria/1.6.1/themes/folio/galleria.folio.min.js');
-                Galleria.run('.galleria', { 
-                    dataSource: data[c],
-                    thumbnails: 'lazy',
-                    _onClick: function(e) { e.openLightbox(); }
-                });
-                Galleria.ready(function() {
-                    this.lazyLoadChunks(10);
+            var url = new URL(window.location.href);
+            var c = Math.max(0, Math.min(parseInt(url.searchParams.get("page")) || 0, gallery.pages - 1));
+
+            // every page file is a call to this with its own entries
+            function swag_page(data) {
+                $(function() {
+                    Galleria.loadTheme('https://cdnjs.cloudflare.com/ajax/libs/galleria/1.6.1/themes/folio/galleria.folio.min.js');
+                    Galleria.run('.galleria', { 
+                        dataSource: data,
+                        thumbnails: 'lazy',
+                        _onClick: function(e) { e.openLightbox(); }
+                    });
+                    Galleria.ready(function() {
+                        this.lazyLoadChunks(10);
+                    });
                 });
+            }
+
+            $(function() {
+                var pager = $('.pager');
+                if (gallery.pages < 2)
+                    return;
+                if (c > 0)
+                    pager.append($('<a>').attr('href', '?page=' + (c - 1)).text('previous'), ' ');
+                pager.append('page ' + (c + 1) + ' of ' + gallery.pages);
+                if (c + 1 < gallery.pages)
+                    pager.append(' ', $('<a>').attr('href', '?page=' + (c + 1)).text('next'));
             });
+
+            if (gallery.pages > 0) {
+                var page = document.createElement('script');
+                page.src = 'thumbs/gallery/' + c + '.js';
+                document.head.appendChild(page);
+            }
         </script>
     </head>
     <body>
@@ -85,276 +125,933 @@ std::string html = R"html(<!doctype html>
             <p>Demonstrating a basic gallery example.</p>
             <div class="galleria">
             </div>
+            <p class="pager"></p>
         </div>
     </body>
 </html>
 )html";
 
-struct image
-{
-    unsigned num_components;
-    unsigned width;
-    unsigned height;
-    unsigned output_width;
-    unsigned output_height;
-    J_COLOR_SPACE colorspace;
-
-    std::string in_filename;
-    std::string out_filename;
-
-    unsigned scalewidth;
-    unsigned scaleheight;
-    unsigned char* data;
-};
-
 namespace Swag
 {
-    bool load_image_jpeg(image* img)
+    // jpeg markers up to the first scan, minus APPn and COM segments, then
+    // the scan data, as (offset, size) ranges with neighbours joined. copies
+    // that only differ in exif tags or comments get the same key
+    static void jpeg_key_ranges(const unsigned char* p, size_t size, std::vector<std::pair<size_t, size_t>>& ranges)
     {
-        jpeg_decompress_struct dinfo;
-        jpeg_error_mgr jerr_mgr;
+        size_t pos = 2;
+        auto keep = [&](size_t from, size_t to) {
+            if (!ranges.empty() && ranges.back().first + ranges.back().second == from)
+                ranges.back().second += to - from;
+            else
+                ranges.emplace_back(from, to - from);
+        };
+
+        ranges.clear();
+        keep(0, 2);
+        while (pos + 4 <= size && p[pos] == 0xFF)
+        {
+            unsigned char marker = p[pos + 1];
 
-        unsigned char* pr;
-        unsigned row_width;
-        JSAMPARRAY samp;
-        FILE* infile;
+            // fill bytes
+            if (marker == 0xFF)
+            {
+                pos++;
+                continue;
+            }
 
-        dinfo.err = jpeg_std_error(&jerr_mgr);
-        jerr_mgr.error_exit = [](j_common_ptr cinfo) { throw cinfo->err; };
+            if (marker == 0xDA)
+                break;
 
-        if ((infile = fopen(img->in_filename.c_str(), "rb")) == NULL)
-        {
-            std::cout << "can't fopen " << img->in_filename << ": " << strerror(errno);
-            return false;
+            size_t end = std::min(size, pos + 2 + ((p[pos + 2] << 8) | p[pos + 3]));
+            if (!((marker >= 0xE0 && marker <= 0xEF) || marker == 0xFE))
+                keep(pos, end);
+            pos = end;
         }
 
-        jpeg_create_decompress(&dinfo);
-        jpeg_stdio_src(&dinfo, infile);
-        jpeg_read_header(&dinfo, FALSE);
+        keep(pos, size);
+    }
 
-        img->width = dinfo.image_width;
-        img->height = dinfo.image_height;
-        img->num_components = dinfo.num_components;
+    // a picture's bytes, mapped or read in
+    struct loaded_file
+    {
+        input_file infile;
+        std::vector<unsigned char> contents;
+        const unsigned char* data = NULL;
+        size_t size = 0;
 
-        double ratio = (double)img->width / (double)img->height;
-        img->scaleheight = def_scaleheight;
-        img->scalewidth = (int)((double)img->scaleheight * ratio + 0.5);
+        bool load(const std::string& filename)
+        {
+            if (!infile.open(filename, def_mmap))
+                return false;
 
-        if (img->width >= 8 * img->scalewidth)
-            dinfo.scale_denom = 8;
-        else if (img->width >= 4 * img->scalewidth)
-            dinfo.scale_denom = 4;
-        else if (img->width >= 2 * img->scalewidth)
-            dinfo.scale_denom = 2;
+            if (infile.data)
+            {
+                data = infile.data;
+                size = infile.size;
+                return true;
+            }
 
-        jpeg_start_decompress(&dinfo);
-        img->output_width = dinfo.output_width;
-        img->output_height = dinfo.output_height;
-        img->colorspace = dinfo.out_color_space;
-        row_width = dinfo.output_width * img->num_components;
+            unsigned char chunk[65536];
+            size_t n;
 
-        img->data = (unsigned char*)malloc(row_width * dinfo.output_height * sizeof(unsigned char));
+            while ((n = fread(chunk, 1, sizeof(chunk), infile.file)) > 0)
+                contents.insert(contents.end(), chunk, chunk + n);
 
-        samp = (*dinfo.mem->alloc_sarray)((j_common_ptr)&dinfo, JPOOL_IMAGE, row_width, 1);
+            if (ferror(infile.file))
+            {
+                std::cout << "Read error on " << filename << std::endl;
+                return false;
+            }
 
-        pr = img->data;
-        while (dinfo.output_scanline < dinfo.output_height)
-        {
-            jpeg_read_scanlines(&dinfo, samp, 1);
-            memcpy(pr, *samp, row_width * sizeof(char));
-            pr += row_width;
+            data = contents.data();
+            size = contents.size();
+            return true;
         }
+    };
+
+    // pictures hashed at once: one per AVX2 lane of md5_many(), and no more
+    // read into memory than that
+    static const size_t content_batch = 8;
+
+    // thumbnail names derived from what the files hold instead of where
+    // they are, so copies share one thumbnail and renaming a folder costs
+    // nothing. keys[i] is left empty when filenames[i] can't be read. md5
+    // keys go through md5_many() a batch at a time; jpegs whose key skips
+    // some segments are joined into one buffer for it first
+    static void content_keys(const std::vector<std::string>& filenames, std::vector<std::string>& keys)
+    {
+        std::vector<std::pair<size_t, size_t>> ranges;
 
-        jpeg_finish_decompress(&dinfo);
-        jpeg_destroy_decompress(&dinfo);
+        keys.assign(filenames.size(), "");
+        for (size_t first = 0; first < filenames.size(); first += content_batch)
+        {
+            size_t count = std::min(content_batch, filenames.size() - first);
+            loaded_file files[content_batch];
+            std::vector<unsigned char> joined[content_batch];
+            const unsigned char* data[content_batch];
+            size_t sizes[content_batch], index[content_batch];
+            std::string digests[content_batch];
+            size_t loaded = 0;
+            uint64_t start = stats_now();
+
+            for (size_t f = 0; f < count; f++)
+            {
+                loaded_file& file = files[f];
 
-        fclose(infile);
+                if (!file.load(filenames[first + f]))
+                    continue;
 
-        return true;
-    }
+                if (file.size >= 4 && file.data[0] == 0xFF && file.data[1] == 0xD8)
+                    jpeg_key_ranges(file.data, file.size, ranges);
+                else
+                    ranges.assign(1, std::make_pair((size_t)0, file.size));
 
-    static void resize_bilinear(unsigned num_components, unsigned output_width, unsigned output_height, unsigned out_width, unsigned out_height,
-                                const unsigned char* p, unsigned char* o)
-    {
-        double factor, fraction_x, fraction_y, one_minus_x, one_minus_y;
-        unsigned ceil_x, ceil_y, floor_x, floor_y, s_row_width;
-        unsigned tcx, tcy, tfx, tfy, tx, ty, t_row_width, x, y;
-
-        /* RGB images have 3 components, grayscale images have only one. */
-        s_row_width = num_components * output_width;
-        t_row_width = num_components * out_width;
-        factor = (double)output_width / (double)out_width;
-        for (y = 0; y < out_height; y++)
-        {
-            for (x = 0; x < out_width; x++)
-            {
-                floor_x = (unsigned)(x * factor);
-                floor_y = (unsigned)(y * factor);
-                ceil_x = (floor_x + 1 > out_width) ? floor_x : floor_x + 1;
-                ceil_y = (floor_y + 1 > out_height) ? floor_y : floor_y + 1;
-                fraction_x = (x * factor) - floor_x;
-                fraction_y = (y * factor) - floor_y;
-                one_minus_x = 1.0 - fraction_x;
-                one_minus_y = 1.0 - fraction_y;
-
-                tx = x * num_components;
-                ty = y * t_row_width;
-                tfx = floor_x * num_components;
-                tfy = floor_y * s_row_width;
-                tcx = ceil_x * num_components;
-                tcy = ceil_y * s_row_width;
-
-                o[tx + ty] = one_minus_y * (one_minus_x * p[tfx + tfy] + fraction_x * p[tcx + tfy]) +
-                            fraction_y * (one_minus_x * p[tfx + tcy] + fraction_x * p[tcx + tcy]);
-
-                if (num_components != 1)
+                if (def_hash != HASH_MD5)
                 {
-                    o[tx + ty + 1] = one_minus_y * (one_minus_x * p[tfx + tfy + 1] + fraction_x * p[tcx + tfy + 1]) +
-                                    fraction_y * (one_minus_x * p[tfx + tcy + 1] + fraction_x * p[tcx + tcy + 1]);
+                    std::unique_ptr<hasher> hash = make_hasher(def_hash);
+
+                    for (auto& r : ranges)
+                        hash->update(file.data + r.first, r.second);
+                    keys[first + f] = hash->hexdigest();
+                    continue;
+                }
 
-                    o[tx + ty + 2] = one_minus_y * (one_minus_x * p[tfx + tfy + 2] + fraction_x * p[tcx + tfy + 2]) +
-                                    fraction_y * (one_minus_x * p[tfx + tcy + 2] + fraction_x * p[tcx + tcy + 2]);
+                if (ranges.size() == 1)
+                {
+                    data[loaded] = file.data + ranges[0].first;
+                    sizes[loaded] = ranges[0].second;
+                }
+                else
+                {
+                    for (auto& r : ranges)
+                        joined[f].insert(joined[f].end(), file.data + r.first, file.data + r.first + r.second);
+                    data[loaded] = joined[f].data();
+                    sizes[loaded] = joined[f].size();
                 }
+                index[loaded++] = first + f;
             }
+
+            md5_many(data, sizes, loaded, digests);
+            for (size_t m = 0; m < loaded; m++)
+                keys[index[m]] = digests[m];
+
+            // one sample per batch, the files in it are hashed together
+            stats_add(STAGE_HASH, start);
         }
     }
 
-    bool create_thumbnail(image* img)
+    void save_file(std::string& st, std::string filename)
     {
-        jpeg_compress_struct cinfo;
-        jpeg_error_mgr jerr_mgr;
-        unsigned int img_datasize;
-        unsigned char* o;
-        JSAMPROW row_pointer[1];
-        FILE *outfile;
+        std::ofstream o(filename);
+        o << st << std::endl;
+        o.close();
+    }
+
+} // namespace Swag
 
-        img_datasize = img->scalewidth * img->scaleheight * img->num_components;
+// everything made for the picture named key, relative to basepath: the
+// thumbnail sizes largest first, then the --tiles descriptor
+static std::vector<std::string> picture_outputs(const std::string& key)
+{
+    std::vector<std::string> outputs = Swag::thumbnail_filenames(Swag::thumbnail_path(key), Swag::command_line_options());
+
+    if (def_tiles)
+        outputs.push_back(Swag::tiles_filename(Swag::thumbnail_path(key)));
+    return outputs;
+}
 
-        if (img->output_width == img->scalewidth && (img->output_height == img->scaleheight || img->output_height == img->scaleheight + 1))
-            o = img->data;
+// what one pass over pictures shares, the initial walk or a --watch batch
+struct gallery_run
+{
+    std::string basepath;
+    bool rebuild = false;
+    Manifest manifest;
+    std::unordered_map<std::string, std::string> owners;
+    std::unique_ptr<WorkPool> pool;
+    unsigned uptodate = 0, generated = 0, duplicates = 0;
+    // a --shard run only sees its own pictures, stale thumbnails are left
+    // for merge to find
+    bool partial = false;
+};
+
+// what add_pictures() knows about a picture before deciding on it
+struct picture
+{
+    std::string in_filename;
+    std::string in_rel;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    std::string key;
+    std::vector<std::string> outputs;
+    bool fresh = false;
+};
+
+// queue the thumbnails of one picture unless they are up to date, and
+// return its gallery entry. p.key is its content key, if it has one yet
+static Swag::gallery_entry add_picture(gallery_run& run, picture& p)
+{
+    image i;
+    std::string& in_rel = p.in_rel;
+    std::string& key = p.key;
+    std::vector<std::string>& outputs = p.outputs;
+    uint64_t size = p.size;
+    int64_t mtime = p.mtime;
+    bool fresh = p.fresh;
+
+    i.in_filename = p.in_filename;
+
+    if (!fresh) {
+        // by path, or because the picture couldn't be read for its content key
+        if (key.empty()) {
+            uint64_t start = Swag::stats_now();
+            key = Swag::hash_string(def_hash, i.in_filename);
+            Swag::stats_add(Swag::STAGE_HASH, start);
+        }
+
+        outputs = picture_outputs(key);
+        if (!def_content_keys)
+            fresh = run.manifest.fresh(in_rel, size, mtime, outputs) && !run.rebuild;
+    }
+
+    i.out_filename = run.basepath+Swag::thumbnail_path(key);
+    std::string out_rel = i.out_filename.substr(run.basepath.size());
+
+    bool exists = true;
+    uint64_t start = Swag::stats_now();
+    for (auto& o : outputs)
+        exists = exists && access((run.basepath+o).c_str(), F_OK) == 0;
+    Swag::stats_add(Swag::STAGE_STAT, start);
+
+    auto owner = run.owners.find(key);
+
+    if (fresh && exists) {
+        run.uptodate++;
+    }
+    else if (owner != run.owners.end()) {
+        // same picture as one already queued, share its thumbnail
+        std::cout << "Duplicate of " << owner->second << ": " << i.in_filename << std::endl;
+        run.manifest.update(in_rel, size, mtime, outputs);
+        run.duplicates++;
+    }
+    else if (def_content_keys && exists && !run.rebuild) {
+        // a copy of a picture from an earlier run, or a moved one
+        run.manifest.update(in_rel, size, mtime, outputs);
+        run.uptodate++;
+    }
+    else {
+        std::cout << "Generating thumbnail: " << i.in_filename << std::endl;
+        run.generated++;
+
+        if (def_content_keys)
+            run.owners[key] = i.in_filename;
+
+        // routine only create thumbs, doesn't care about paths
+        auto job = [i, in_rel, outputs, size, mtime, &manifest = run.manifest]() mutable {
+            uint64_t start = Swag::stats_now();
+            if (Swag::generate_thumbnail(&i) && (!def_tiles || Swag::generate_tiles(&i)))
+                manifest.update(in_rel, size, mtime, outputs);
+            Swag::stats_file(i.in_filename, start);
+        };
+
+        if (run.pool)
+            run.pool->submit(job);
         else
-        {
-            o = (unsigned char*)malloc(img_datasize * sizeof(unsigned char));
+            job();
+    }
+
+    // chop off base path from filename
+    i.in_filename = in_rel;
+    i.out_filename = out_rel;
+
+
+    return Swag::gallery_entry{i.out_filename, def_bigheights.empty() ? "" : outputs.front(), i.in_filename,
+                               def_tiles ? outputs.back() : ""};
+}
+
+// queue the thumbnails of pictures unless they are up to date, and return
+// their gallery entries in the same order. pictures that need a content
+// key are hashed together first, so md5 keys of several files go through
+// the multi-buffer hasher at once
+static std::vector<Swag::gallery_entry> add_pictures(gallery_run& run, const std::vector<std::string>& in_filenames)
+{
+    std::vector<picture> pictures(in_filenames.size());
+    std::vector<std::string> unhashed, keys;
+    std::vector<size_t> unhashed_index;
+
+    for (size_t n = 0; n < pictures.size(); n++) {
+        picture& p = pictures[n];
+        struct stat st;
+
+        p.in_filename = in_filenames[n];
 
-            resize_bilinear(img->num_components, img->output_width, img->output_height, img->scalewidth, img->scaleheight, img->data, o);
+        // the manifest works on paths relative to basepath
+        p.in_rel = p.in_filename.substr(run.basepath.size());
 
-            free(img->data);
+        uint64_t start = Swag::stats_now();
+        if (stat(p.in_filename.c_str(), &st) == 0) {
+            p.size = st.st_size;
+            p.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        }
+        Swag::stats_add(Swag::STAGE_STAT, start);
+
+        if (def_content_keys && run.manifest.recorded(p.in_rel, p.size, p.mtime, p.outputs) && !p.outputs.empty()) {
+            // unchanged since it was hashed, keep that key as long as
+            // it was a content key for the current sizes
+            p.key = fs::path(p.outputs.back()).stem();
+            p.fresh = !run.rebuild && p.key != Swag::hash_string(def_hash, p.in_filename) &&
+                      p.outputs == picture_outputs(p.key);
         }
-        img->data = NULL;
 
-        if ((outfile = fopen(img->out_filename.c_str(), "wb")) == NULL)
-        {
-            std::cout << "Could not open " << strerror(errno) << std::endl;
-            return 0;
+        if (def_content_keys && !p.fresh) {
+            unhashed.push_back(p.in_filename);
+            unhashed_index.push_back(n);
         }
+    }
 
-        cinfo.err = jpeg_std_error(&jerr_mgr);
-        jerr_mgr.error_exit = [](j_common_ptr cinfo) { throw cinfo->err; };
+    Swag::content_keys(unhashed, keys);
+    for (size_t u = 0; u < unhashed.size(); u++)
+        pictures[unhashed_index[u]].key = keys[u];
 
-        jpeg_create_compress(&cinfo);
-        jpeg_stdio_dest(&cinfo, outfile);
+    std::vector<Swag::gallery_entry> entries;
+    for (auto& p : pictures)
+        entries.push_back(add_picture(run, p));
+    return entries;
+}
 
-        cinfo.image_width = img->scalewidth;
-        cinfo.image_height = img->scaleheight;
-        cinfo.input_components = img->num_components;
-        cinfo.in_color_space = img->colorspace;
+// fan-out directories above a thumbnail that was moved or removed, as far
+// up as they are empty
+static void remove_empty_dirs(const std::string& basepath, const std::string& thumb)
+{
+    for (size_t slash = thumb.rfind('/'); slash > strlen("/thumbs"); slash = thumb.rfind('/', slash - 1))
+        if (rmdir((basepath + thumb.substr(0, slash)).c_str()) != 0)
+            break;
+}
 
-        jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, 50, FALSE);
-        jpeg_start_compress(&cinfo, FALSE);
+// a --tiles descriptor, whose tiles go wherever it goes
+static bool tiles_output(const std::string& output)
+{
+    return output.size() > 4 && output.compare(output.size() - 4, 4, ".dzi") == 0;
+}
 
-        while (cinfo.next_scanline < cinfo.image_height)
-        {
-            row_pointer[0] = &o[cinfo.input_components * cinfo.image_width * cinfo.next_scanline];
-            jpeg_write_scanlines(&cinfo, row_pointer, 1);
+static void remove_output(const std::string& basepath, const std::string& output)
+{
+    remove((basepath + output).c_str());
+    if (tiles_output(output))
+        Swag::remove_tree(basepath + Swag::tiles_directory(output));
+    remove_empty_dirs(basepath, output);
+}
+
+// move the thumbnails of an earlier run with another layout (the flat
+// directory, or a different --fanout) to where thumbnail_path() wants them
+static void migrate_thumbnails(Manifest& manifest, const std::string& basepath)
+{
+    auto moves = manifest.relocate([](const std::string& output) {
+        std::string name = output.substr(output.rfind('/') + 1);
+        std::string path = Swag::thumbnail_path(name.substr(0, name.find_first_of("_.")));
+
+        return path.substr(0, path.rfind('/') + 1) + name;
+    });
+    unsigned moved = 0;
+
+    for (auto& m : moves) {
+        std::string from = basepath + m.first, to = basepath + m.second;
+
+        if (rename(from.c_str(), to.c_str()) != 0 && !(errno == ENOENT && Swag::make_parent_dirs(to) &&
+                                                       rename(from.c_str(), to.c_str()) == 0))
+            continue;
+
+        if (tiles_output(m.first))
+            rename((basepath + Swag::tiles_directory(m.first)).c_str(), (basepath + Swag::tiles_directory(m.second)).c_str());
+
+        remove_empty_dirs(basepath, m.first);
+        moved++;
+    }
+
+    if (moved)
+        std::cout << "Moved " << moved << " thumbnails to the new layout" << std::endl;
+}
+
+// wait for the workers, drop the thumbnails nothing refers to anymore and
+// save the manifest
+static void finish_run(gallery_run& run, const std::string& manifest_file)
+{
+    if (run.pool)
+        run.pool->wait();
+
+    // thumbnails whose source went away since the last run
+    std::vector<std::string> stale = run.manifest.prune();
+    if (run.partial)
+        stale.clear();
+
+    for (auto& t : stale) {
+        std::cout << "Removing stale thumbnail: " << t << std::endl;
+        remove_output(run.basepath, t);
+    }
+
+    run.manifest.save(manifest_file);
+
+    std::cout << run.generated << " thumbnails generated, " << run.uptodate << " up to date, "
+              << run.duplicates << " duplicates, " << stale.size() << " removed" << std::endl;
+}
+
+// which of count shards a picture belongs to, from its path relative to
+// basepath so every node agrees whatever else differs
+static unsigned shard_of(const std::string& in_rel, unsigned count)
+{
+    Swag::fast_hash hash;
+    uint64_t low, high;
+
+    hash.update((const unsigned char*)in_rel.data(), in_rel.size());
+    hash.digest(low, high);
+    return low % count;
+}
+
+// the manifest and gallery part of shard index, without the extension
+static std::string shard_part(const std::string& basepath, unsigned index, unsigned count)
+{
+    return basepath + "/thumbs/shards/" + std::to_string(index) + "-of-" + std::to_string(count);
+}
+
+// fold the outputs of every --shard run into the manifest and gallery a
+// single run would have written, and remove the thumbnails none of them
+// refers to anymore
+static int merge_shards(const std::string& basepath, unsigned page_size)
+{
+    std::map<unsigned, std::vector<unsigned>> found;
+    std::error_code error;
+
+    for (auto& e : fs::directory_iterator(basepath + "/thumbs/shards", error)) {
+        std::string stem = e.path().stem().string();
+        unsigned index, count;
+        char rest;
+
+        if (e.path().extension() == ".gallery" && sscanf(stem.c_str(), "%u-of-%u%c", &index, &count, &rest) == 2)
+            found[count].push_back(index);
+    }
+
+    if (found.size() != 1) {
+        std::cout << (found.empty() ? "No --shard outputs in " : "Outputs of different --shard counts in ")
+                  << basepath << "/thumbs/shards" << std::endl;
+        return 1;
+    }
+
+    unsigned count = found.begin()->first;
+    std::vector<unsigned>& indexes = found.begin()->second;
+    std::sort(indexes.begin(), indexes.end());
+
+    for (unsigned k = 0; k < count; k++) {
+        if (!std::binary_search(indexes.begin(), indexes.end(), k)) {
+            std::cout << "Shard " << k << "/" << count << " hasn't finished, nothing merged" << std::endl;
+            return 1;
         }
+    }
 
-        jpeg_finish_compress(&cinfo);
+    std::string manifest_file = basepath+"/thumbs/swag.manifest";
+    std::vector<std::string> galleries;
+    Manifest manifest;
 
-        fflush(outfile);
-        fclose(outfile);
+    manifest.load(manifest_file);
+    for (unsigned k = 0; k < count; k++) {
+        std::string part = shard_part(basepath, k, count);
 
-        jpeg_destroy_compress(&cinfo);
-        free(o);
+        if (!manifest.merge(part + ".manifest")) {
+            std::cout << "Could not read " << part << ".manifest" << std::endl;
+            return 1;
+        }
+        galleries.push_back(part + ".gallery");
+    }
 
-        return true;
+    Swag::gallery_writer gallery(basepath, page_size);
+    if (!Swag::merge_gallery_parts(galleries, gallery))
+        return 1;
+
+    // what the last merge or single run had and no shard has now
+    std::vector<std::string> stale = manifest.prune();
+    for (auto& t : stale) {
+        std::cout << "Removing stale thumbnail: " << t << std::endl;
+        remove_output(basepath, t);
     }
 
-    void save_file(std::string& st, std::string filename)
-    {
-        std::ofstream o(filename);
-        o << st << std::endl;
-        o.close();
+    Swag::save_file(html, basepath+"/index.html");
+    if (!manifest.save(manifest_file) || !gallery.finish())
+        return 1;
+
+    // merged for good, a later merge needs fresh shard runs
+    for (unsigned k = 0; k < count; k++) {
+        remove((shard_part(basepath, k, count) + ".manifest").c_str());
+        remove((shard_part(basepath, k, count) + ".gallery").c_str());
     }
+    rmdir((basepath + "/thumbs/shards").c_str());
 
-} // namespace Swag
+    std::cout << "Merged " << count << " shards into " << gallery.pages() << " gallery pages, " << stale.size()
+              << " removed" << std::endl;
+    return 0;
+}
 
-int main()
+int main(int argc, char* argv[])
 {
-    int count = 0;
-    std::string json,data;
-    std::string stem;
-    std::string basepath("/home/cassiano.old/Pictures");
-    fs::path current_dir(basepath);
+    unsigned jobs = 1;
+    bool jobs_given = false;
+    unsigned scan_threads = 4;
+    unsigned page_size = 100;
+    bool watch = false;
+    bool serve = argc > 1 && std::string(argv[1]) == "serve";
+    bool merge = argc > 1 && std::string(argv[1]) == "merge";
+    unsigned shard_index = 0, shard_count = 0;
+    std::string listen_address = "127.0.0.1";
+    unsigned port = 8080;
+    size_t cache_mb = 256;
+    size_t mem_limit_mb = 0;
+    gallery_run run;
+    std::string& basepath = run.basepath;
+    bool stats_table = false;
+    bool filter_given = false;
+    std::string stats_json;
+
+    for (int a = serve || merge ? 2 : 1; a < argc; a++) {
+        std::string arg(argv[a]);
+
+        if (arg == "-j" && a + 1 < argc) {
+            jobs = strtoul(argv[++a], NULL, 10);
+            jobs_given = true;
+        }
+        else if (arg.compare(0, 2, "-j") == 0) {
+            jobs = strtoul(arg.c_str() + 2, NULL, 10);
+            jobs_given = true;
+        }
+        else if (arg == "--scan-threads" && a + 1 < argc)
+            scan_threads = std::max(1ul, strtoul(argv[++a], NULL, 10));
+        else if (arg == "--page-size" && a + 1 < argc)
+            page_size = std::max(1ul, strtoul(argv[++a], NULL, 10));
+        else if (arg == "--rebuild")
+            run.rebuild = true;
+        else if (arg == "--watch")
+            watch = true;
+        else if (arg == "--listen" && a + 1 < argc)
+            listen_address = argv[++a];
+        else if (arg == "--port" && a + 1 < argc)
+            port = strtoul(argv[++a], NULL, 10);
+        else if (arg == "--shard" && a + 1 < argc) {
+            // K/N, K counting from 0
+            char* end;
+            shard_index = strtoul(argv[++a], &end, 10);
+            shard_count = *end == '/' ? strtoul(end + 1, &end, 10) : 0;
+
+            if (*end || shard_index >= shard_count) {
+                std::cout << "--shard needs K/N with K from 0 to N-1, e.g. 0/8" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--fanout" && a + 1 < argc)
+            def_fanout = std::min(4ul, strtoul(argv[++a], NULL, 10));
+        else if (arg == "--cache-mb" && a + 1 < argc)
+            cache_mb = strtoul(argv[++a], NULL, 10);
+        else if (arg == "--mem-limit" && a + 1 < argc)
+            mem_limit_mb = strtoul(argv[++a], NULL, 10);
+        else if (arg == "--stream")
+            def_stream = true;
+        else if (arg == "--mmap")
+            def_mmap = true;
+        else if (arg == "--exif")
+            def_exif = true;
+        else if (arg == "--content-keys")
+            def_content_keys = true;
+        else if (arg == "--tiles")
+            def_tiles = true;
+        else if (arg == "--stats")
+            Swag::stats_enabled = stats_table = true;
+        else if (arg == "--stats-json" && a + 1 < argc) {
+            Swag::stats_enabled = true;
+            stats_json = argv[++a];
+        }
+        else if (arg == "--stats-top" && a + 1 < argc)
+            Swag::stats_slowest = strtoul(argv[++a], NULL, 10);
+        else if (arg == "--sizes" && a + 1 < argc) {
+            // the smallest height is the thumbnail, the others are extra
+            // sizes cascaded from the same decode
+            std::vector<unsigned> heights;
+            std::stringstream list(argv[++a]);
+            std::string item;
+
+            while (std::getline(list, item, ','))
+                if (unsigned h = strtoul(item.c_str(), NULL, 10))
+                    heights.push_back(h);
+
+            std::sort(heights.begin(), heights.end());
+            heights.erase(std::unique(heights.begin(), heights.end()), heights.end());
+
+            if (heights.empty()) {
+                std::cout << "--sizes needs a list of heights, e.g. 200,400,800" << std::endl;
+                return 1;
+            }
+
+            def_scaleheight = heights.front();
+            def_bigheights.assign(heights.begin() + 1, heights.end());
+        }
+        else if (arg == "--hash" && a + 1 < argc) {
+            if (!Swag::parse_hash(argv[++a], def_hash)) {
+                std::cout << "Unknown hash " << argv[a] << ", use md5, fast64 or fast128" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--filter" && a + 1 < argc) {
+            if (!Swag::parse_filter(argv[++a], def_filter)) {
+                std::cout << "Unknown filter " << argv[a] << ", use bilinear, box, catmull-rom or lanczos3" << std::endl;
+                return 1;
+            }
+            filter_given = true;
+        }
+        else if (arg == "--profile" && a + 1 < argc) {
+            if (!Swag::parse_profile(argv[++a], def_profile)) {
+                std::cout << "Unknown profile " << argv[a] << ", use fast, balanced or best" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--crop" && a + 1 < argc) {
+            if (!Swag::parse_crop(argv[++a], def_crop)) {
+                std::cout << "Unknown crop " << argv[a] << ", use none, center or focus" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--aspect" && a + 1 < argc) {
+            // W:H, e.g. 1:1 or 4:3
+            char* end;
+            unsigned long w = strtoul(argv[++a], &end, 10);
+            unsigned long h = *end == ':' ? strtoul(end + 1, &end, 10) : 0;
+
+            if (!w || !h || *end || w > 1000 || h > 1000) {
+                std::cout << "--aspect needs a shape like 1:1 or 4:3" << std::endl;
+                return 1;
+            }
+
+            def_aspect_width = w;
+            def_aspect_height = h;
+        }
+        else if (arg == "--quality" && a + 1 < argc)
+            def_quality = std::min(100, std::max(1, atoi(argv[++a])));
+        else if (arg == "--optimize")
+            def_optimize = true;
+        else if (arg == "--progressive")
+            def_progressive = true;
+        else if (arg == "--subsampling" && a + 1 < argc) {
+            def_subsampling = strtoul(argv[++a], NULL, 10);
+            if (def_subsampling != 444 && def_subsampling != 422 && def_subsampling != 420) {
+                std::cout << "Unknown subsampling " << argv[a] << ", use 444, 422 or 420" << std::endl;
+                return 1;
+            }
+        }
+        else
+            basepath = arg;
+    }
+
+    if (basepath.empty()) {
+        std::cout << "usage: " << argv[0] << " [options] basepath" << std::endl;
+        std::cout << "       " << argv[0] << " serve [options] basepath" << std::endl;
+        std::cout << "       " << argv[0] << " merge [options] basepath" << std::endl;
+        return 1;
+    }
+
+    // paths are built as basepath + "/" + relative
+    while (basepath.size() > 1 && basepath.back() == '/')
+        basepath.pop_back();
+
+    // best decodes at twice the size or more, which bilinear would alias
+    if (def_profile == Swag::PROFILE_BEST && !filter_given)
+        def_filter = Swag::FILTER_CATMULL_ROM;
+
+    // -j 0 means one worker per core, which is also what serve decodes on
+    if (serve && !jobs_given)
+        jobs = 0;
+    if (jobs == 0)
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+
+    // decodes reserve their frames against this once the header is read
+    if (mem_limit_mb) {
+        mem_budget.reset(new Swag::memory_budget(mem_limit_mb << 20, jobs));
+        def_budget = mem_budget.get();
+    }
+
+    if (shard_count && (serve || merge || watch)) {
+        std::cout << "--shard is for plain runs, merge their outputs with " << argv[0] << " merge" << std::endl;
+        return 1;
+    }
 
     fs::create_directory(basepath+"/thumbs");
 
-    for (auto file = fs::recursive_directory_iterator(current_dir);
-              file != fs::recursive_directory_iterator(); ++file) {
+    if (merge)
+        return merge_shards(basepath, page_size);
 
-        // ignore any thumbs folder
-        if(file->path().stem() == "thumbs") {
-            std::cout << "Ignored: " << file->path().stem() << std::endl;
-            file.disable_recursion_pending();
-            continue;
+    if (serve) {
+        if (def_content_keys) {
+            std::cout << "serve names thumbnails after their path, --content-keys needs a normal run" << std::endl;
+            return 1;
+        }
+        if (def_tiles) {
+            std::cout << "serve only makes thumbnails, --tiles needs a normal run" << std::endl;
+            return 1;
         }
 
-        if((stem != file->path().parent_path().stem()) && file->is_directory()) {
-            std::cout << "Scanning " << file->path().stem() << std::endl;
-            stem = file->path().parent_path().stem();
+        // thumbnails are found where a normal run with the same options
+        // would look for them
+        Manifest manifest;
+        std::string manifest_file = basepath+"/thumbs/swag.manifest";
+        if (manifest.load(manifest_file)) {
+            migrate_thumbnails(manifest, basepath);
+            manifest.save(manifest_file);
         }
 
-        std::string s(file->path().extension());
-        std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+        // only the gallery is written up front, thumbnails are made when
+        // a browser first asks for them
+        Swag::gallery_writer gallery(basepath, page_size);
+        Server::source_map thumbnails;
+        Scanner scanner(scan_threads, {".jpg", ".png"});
+        Swag::thumbnail_options options = Swag::command_line_options();
+        unsigned pictures = 0;
+
+        bool scanned = scanner.scan(basepath, [&](const Scanner::batch& b) {
+            for (auto& name : b.files) {
+                std::string in_filename = basepath + "/" + (b.dir.empty() ? "" : b.dir + "/") + name;
+                std::string thumb = Swag::thumbnail_path(Swag::hash_string(def_hash, in_filename));
+                std::vector<std::string> outputs = Swag::thumbnail_filenames(thumb, options);
+
+                for (auto& o : outputs)
+                    thumbnails[o] = Server::thumbnail_source{in_filename, thumb};
+
+                gallery.add(Swag::gallery_entry{thumb, def_bigheights.empty() ? "" : outputs.front(),
+                                                in_filename.substr(basepath.size())});
+                pictures++;
+            }
+        });
 
-        if (s == ".jpg") {
-            image i;
+        Swag::save_file(html, basepath+"/index.html");
+        if (!scanned || !gallery.finish())
+            return 1;
 
-            i.in_filename = file->path().string();
-            i.out_filename = basepath+"/thumbs/"+md5(i.in_filename)+".jpg";
+        Server server(basepath, std::move(thumbnails), jobs, cache_mb << 20);
+        if (!server.listen(listen_address, port))
+            return 1;
 
-            std::cout << "Generating thumbnail: " << i.in_filename << std::endl;
+        std::cout << pictures << " pictures on " << gallery.pages() << " gallery pages, serving http://"
+                  << listen_address << ":" << port << "/" << std::endl;
+        return server.run() ? 0 : 1;
+    }
 
-            // routine only create thumbs, doesn't care about paths
-            // Swag::load_image_jpeg(&i);
-            // Swag::create_thumbnail(&i);
+    std::string manifest_file = basepath+"/thumbs/swag.manifest";
+    run.manifest.load(manifest_file);
 
-            // chop off base path from filename
-            i.in_filename.erase(0, basepath.size());
-            i.out_filename.erase(0, basepath.size());
+    // every shard reads the same manifest, none of them may move files
+    // another one could be looking at
+    if (!shard_count)
+        migrate_thumbnails(run.manifest, basepath);
 
-            data += "{ thumb: '" + i.out_filename + "', image: '" + i.in_filename + "' },";
+    // the scanner hands its batches to this thread, which decides the gallery order; workers
+    // only ever produce thumbnails, so the output doesn't depend on -j
+    if (jobs > 1)
+        run.pool.reset(new WorkPool(jobs));
 
-            if(++count%5==0)
-            {
-                // remove last comma from string
-                if(!data.empty())
-                    data.erase(data.size()-1, 1);
+    Scanner scanner(scan_threads, {".jpg", ".png"});
+
+    if (shard_count) {
+        // the whole tree is walked, but only this shard's pictures are
+        // looked at; the manifest and gallery go to a part for merge
+        std::string part = shard_part(basepath, shard_index, shard_count);
+        fs::create_directory(basepath+"/thumbs/shards");
+        Swag::gallery_part gallery(part + ".gallery");
+        run.partial = true;
 
-                json += "[ "+data+" ],";
-                data.clear();
+        bool scanned = scanner.scan(basepath, [&](const Scanner::batch& b) {
+            std::vector<std::string> mine;
+
+            for (auto& name : b.files) {
+                std::string in_rel = "/" + (b.dir.empty() ? "" : b.dir + "/") + name;
+
+                if (shard_of(in_rel, shard_count) == shard_index)
+                    mine.push_back(basepath + in_rel);
             }
-        }
+
+            for (auto& entry : add_pictures(run, mine))
+                gallery.add(entry);
+        });
+
+        if (!scanned)
+            return 1;
+
+        finish_run(run, part + ".manifest");
+
+        if (stats_table)
+            Swag::stats_report(std::cout);
+        if (!stats_json.empty())
+            Swag::stats_json(stats_json);
+
+        if (!gallery.finish())
+            return 1;
+
+        std::cout << "Shard " << shard_index << "/" << shard_count << " has " << gallery.size()
+                  << " pictures, combine all shards with " << argv[0] << " merge" << std::endl;
+        return 0;
     }
 
-    // remove last comma from string
-    if(!json.empty())
-        json.erase(json.size()-1, 1);
+    if (!watch) {
+        Swag::gallery_writer gallery(basepath, page_size);
+
+        bool scanned = scanner.scan(basepath, [&](const Scanner::batch& b) {
+            if (!b.dir.empty())
+                std::cout << "Scanning " << b.dir << std::endl;
 
-    json = "data = [ "+json+" ];";
- 
-    std::cout << json << std::endl;
+            std::vector<std::string> in_filenames;
+            for (auto& name : b.files)
+                in_filenames.push_back(basepath + "/" + (b.dir.empty() ? "" : b.dir + "/") + name);
+
+            for (auto& entry : add_pictures(run, in_filenames))
+                gallery.add(entry);
+        });
+
+        if (!scanned)
+            return 1;
+
+        finish_run(run, manifest_file);
+
+        if (stats_table)
+            Swag::stats_report(std::cout);
+        if (!stats_json.empty())
+            Swag::stats_json(stats_json);
+
+        Swag::save_file(html, basepath+"/index.html");
+        if (!gallery.finish())
+            return 1;
+
+        std::cout << gallery.pages() << " gallery pages" << std::endl;
+        return 0;
+    }
+
+    // --watch: the same first run, then the gallery is kept in memory and
+    // each batch of changes only touches the pictures and pages it needs
+    Swag::gallery_pages pages(basepath, page_size);
+    Watcher watcher(basepath, {".jpg", ".png"});
+
+    if (!watcher.start())
+        return 1;
+
+    // pictures under dir (a path relative to basepath with a leading "/",
+    // "" for everything), scanned again; what went away leaves the gallery
+    auto rescan = [&](const std::string& dir, std::unordered_set<std::string>& done) {
+        std::unordered_set<std::string> found;
+
+        scanner.scan(basepath + dir, [&](const Scanner::batch& b) {
+            std::string sub = dir + (b.dir.empty() ? "" : "/" + b.dir);
+            if (!sub.empty())
+                std::cout << "Scanning " << sub.substr(1) << std::endl;
+
+            std::vector<std::string> in_filenames;
+
+            for (auto& name : b.files) {
+                std::string image = dir + "/" + (b.dir.empty() ? "" : b.dir + "/") + name;
+
+                found.insert(image);
+                if (done.insert(image).second)
+                    in_filenames.push_back(basepath + image);
+            }
+
+            for (auto& entry : add_pictures(run, in_filenames))
+                pages.put(entry);
+        });
+
+        for (auto& image : pages.prune(dir, found))
+            run.manifest.forget(image);
+    };
+
+    std::unordered_set<std::string> done;
+    rescan("", done);
+    finish_run(run, manifest_file);
+
+    if (stats_table)
+        Swag::stats_report(std::cout);
+    if (!stats_json.empty())
+        Swag::stats_json(stats_json);
 
     Swag::save_file(html, basepath+"/index.html");
-    Swag::save_file(json, basepath+"/gallerydata.js");
-}
\ No newline at end of file
+    if (!pages.flush())
+        return 1;
+
+    std::cout << pages.pages() << " gallery pages, watching " << basepath << " for changes" << std::endl;
+
+    std::map<std::string, Watcher::change> changes;
+    while (watcher.wait(changes)) {
+        uint64_t start = Swag::stats_clock();
+
+        // --rebuild only applies to the first run
+        run.rebuild = false;
+        run.owners.clear();
+        run.uptodate = run.generated = run.duplicates = 0;
+        done.clear();
+
+        // by path, so a folder comes before the files in it
+        for (auto& c : changes) {
+            std::string image = c.first.empty() ? "" : "/" + c.first;
+            struct stat st;
+
+            if (c.second.removed) {
+                for (auto& gone : pages.prune(image, {}))
+                    run.manifest.forget(gone);
+            }
+            else if (c.second.directory)
+                rescan(image, done);
+            else if (done.insert(image).second) {
+                if (stat((basepath + image).c_str(), &st) == 0)
+                    pages.put(add_pictures(run, {basepath + image}).front());
+                else
+                    for (auto& gone : pages.prune(image, {}))
+                        run.manifest.forget(gone);
+            }
+        }
+
+        finish_run(run, manifest_file);
+        if (!pages.flush())
+            return 1;
+
+        std::cout << pages.size() << " pictures on " << pages.pages() << " gallery pages, updated in "
+                  << (Swag::stats_clock() - start) / 1000000 << " ms" << std::endl;
+    }
+
+    return 1;
+}
@@ -0,0 +1,199 @@
+#include "manifest.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+
+static const char* manifest_magic = "swag-manifest 1";
+
+bool Manifest::read(const std::string& filename, const std::function<void(const std::string&, const entry&)>& add)
+{
+    std::ifstream in(filename);
+    std::string line;
+
+    if (!in || !std::getline(in, line) || line != manifest_magic)
+        return false;
+
+    while (std::getline(in, line))
+    {
+        // size \t mtime \t outputs \t path
+        size_t a = line.find('\t');
+        size_t b = a == std::string::npos ? a : line.find('\t', a + 1);
+        size_t c = b == std::string::npos ? b : line.find('\t', b + 1);
+
+        if (c == std::string::npos)
+            continue;
+
+        entry e;
+        e.size = strtoull(line.c_str(), NULL, 10);
+        e.mtime = strtoll(line.c_str() + a + 1, NULL, 10);
+        e.seen = false;
+
+        for (size_t i = b + 1, j; i < c; i = j + 1)
+        {
+            j = std::min(line.find(',', i), c);
+            e.outputs.push_back(line.substr(i, j - i));
+        }
+
+        add(line.substr(c + 1), e);
+    }
+
+    return true;
+}
+
+bool Manifest::load(const std::string& filename)
+{
+    std::lock_guard<std::mutex> l(lock);
+
+    return read(filename, [&](const std::string& path, const entry& e) { entries[path] = e; });
+}
+
+bool Manifest::merge(const std::string& filename)
+{
+    std::lock_guard<std::mutex> l(lock);
+
+    return read(filename, [&](const std::string& path, const entry& e) {
+        auto it = entries.find(path);
+
+        if (it != entries.end())
+            for (auto& o : it->second.outputs)
+                if (std::find(e.outputs.begin(), e.outputs.end(), o) == e.outputs.end())
+                    retired.push_back(o);
+
+        entries[path] = entry{e.size, e.mtime, e.outputs, true};
+    });
+}
+
+bool Manifest::save(const std::string& filename) const
+{
+    // write next to the old one and rename, so a crash mid-run never
+    // leaves a truncated manifest behind
+    std::string tmp = filename + ".tmp";
+    std::ofstream o(tmp);
+
+    o << manifest_magic << '\n';
+
+    std::lock_guard<std::mutex> l(lock);
+    for (auto& it : entries)
+    {
+        o << it.second.size << '\t' << it.second.mtime << '\t';
+        for (size_t i = 0; i < it.second.outputs.size(); i++)
+            o << (i ? "," : "") << it.second.outputs[i];
+        o << '\t' << it.first << '\n';
+    }
+
+    o.close();
+    if (!o || rename(tmp.c_str(), filename.c_str()) != 0)
+    {
+        std::cout << "Could not write " << filename << std::endl;
+        remove(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool Manifest::fresh(const std::string& path, uint64_t size, int64_t mtime, const std::vector<std::string>& outputs)
+{
+    std::lock_guard<std::mutex> l(lock);
+    auto it = entries.find(path);
+
+    if (it == entries.end())
+        return false;
+
+    it->second.seen = true;
+    return it->second.size == size && it->second.mtime == mtime && it->second.outputs == outputs;
+}
+
+bool Manifest::recorded(const std::string& path, uint64_t size, int64_t mtime, std::vector<std::string>& outputs)
+{
+    std::lock_guard<std::mutex> l(lock);
+    auto it = entries.find(path);
+
+    if (it == entries.end())
+        return false;
+
+    it->second.seen = true;
+    if (it->second.size != size || it->second.mtime != mtime)
+        return false;
+
+    outputs = it->second.outputs;
+    return true;
+}
+
+void Manifest::update(const std::string& path, uint64_t size, int64_t mtime, const std::vector<std::string>& outputs)
+{
+    std::lock_guard<std::mutex> l(lock);
+    auto it = entries.find(path);
+
+    if (it != entries.end())
+        for (auto& o : it->second.outputs)
+            if (std::find(outputs.begin(), outputs.end(), o) == outputs.end())
+                retired.push_back(o);
+
+    entries[path] = entry{size, mtime, outputs, true};
+}
+
+void Manifest::forget(const std::string& path)
+{
+    std::lock_guard<std::mutex> l(lock);
+    auto it = entries.find(path);
+
+    if (it == entries.end())
+        return;
+
+    retired.insert(retired.end(), it->second.outputs.begin(), it->second.outputs.end());
+    entries.erase(it);
+}
+
+std::vector<std::pair<std::string, std::string>> Manifest::relocate(const std::function<std::string(const std::string&)>& place)
+{
+    std::map<std::string, std::string> moves;
+
+    std::lock_guard<std::mutex> l(lock);
+    for (auto& e : entries)
+        for (auto& o : e.second.outputs)
+        {
+            std::string to = place(o);
+
+            if (to != o)
+            {
+                moves[o] = to;
+                o = to;
+            }
+        }
+
+    return std::vector<std::pair<std::string, std::string>>(moves.begin(), moves.end());
+}
+
+std::vector<std::string> Manifest::prune()
+{
+    std::vector<std::string> stale;
+    std::set<std::string> live;
+
+    std::lock_guard<std::mutex> l(lock);
+    stale.swap(retired);
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+        if (it->second.seen)
+        {
+            live.insert(it->second.outputs.begin(), it->second.outputs.end());
+            ++it;
+            continue;
+        }
+
+        stale.insert(stale.end(), it->second.outputs.begin(), it->second.outputs.end());
+        it = entries.erase(it);
+    }
+
+    // several inputs may share a thumbnail, keep it while any is left
+    std::sort(stale.begin(), stale.end());
+    stale.erase(std::unique(stale.begin(), stale.end()), stale.end());
+    stale.erase(std::remove_if(stale.begin(), stale.end(), [&](const std::string& s) { return live.count(s) != 0; }),
+                stale.end());
+
+    return stale;
+}
@@ -0,0 +1,80 @@
+#ifndef SWAG_MANIFEST_H
+#define SWAG_MANIFEST_H
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// persistent record of the thumbnails generated by previous runs
+//
+// one line per input: size, mtime (ns), comma separated output names and
+// source path, all relative to the gallery base path. an input whose size
+// and mtime match its entry, and whose thumbnails are still on disk,
+// doesn't need to be decoded again.
+//
+// usage: 1) load() at startup
+//        2) fresh() for every input found by the walk, update() once its
+//           thumbnail has been written (safe from any worker thread)
+//        3) prune() drops the inputs that weren't seen and returns their
+//           thumbnails, then save()
+//
+// a --shard run saves only the inputs of its own shard; merge() folds those
+// files back into the full manifest.
+class Manifest
+{
+public:
+    struct entry
+    {
+        uint64_t size;
+        int64_t mtime;
+        std::vector<std::string> outputs;
+        bool seen;
+    };
+
+    bool load(const std::string& filename);
+    bool save(const std::string& filename) const;
+
+    // load the manifest of a --shard run on top: its entries replace the
+    // ones for the same paths and count as seen, and the outputs they
+    // replace are handed out by prune() as with update()
+    bool merge(const std::string& filename);
+
+    // true when path is recorded with the same size, mtime and outputs.
+    // marks the entry as seen either way
+    bool fresh(const std::string& path, uint64_t size, int64_t mtime, const std::vector<std::string>& outputs);
+
+    // the outputs recorded for path if its size and mtime still match, for
+    // callers that can't name the outputs before looking at the file.
+    // marks the entry as seen either way
+    bool recorded(const std::string& path, uint64_t size, int64_t mtime, std::vector<std::string>& outputs);
+
+    void update(const std::string& path, uint64_t size, int64_t mtime, const std::vector<std::string>& outputs);
+
+    // drop path, whose source is gone; its outputs are handed out by the
+    // next prune() unless another entry still refers to them
+    void forget(const std::string& path);
+
+    // rename every recorded output to place(output) and return the ones
+    // that changed as (old, new) pairs, each once; moving the files is up
+    // to the caller
+    std::vector<std::pair<std::string, std::string>> relocate(const std::function<std::string(const std::string&)>& place);
+
+    // forget every entry that wasn't seen since load(), returning the
+    // thumbnails that no remaining entry refers to, including outputs an
+    // update() replaced
+    std::vector<std::string> prune();
+
+    size_t size() const { return entries.size(); }
+
+private:
+    static bool read(const std::string& filename, const std::function<void(const std::string&, const entry&)>& add);
+
+    mutable std::mutex lock;
+    std::unordered_map<std::string, entry> entries;
+    std::vector<std::string> retired;
+};
+
+#endif
@@ -254,9 +254,10 @@ void MD5::update(const unsigned char input[], size_type length)
   size_type index = count[0] / 8 % blocksize;
  
   // Update number of bits
-  if ((count[0] += (length << 3)) < (length << 3))
+  uint4 bits = (uint4)(length << 3);
+  if ((count[0] += bits) < bits)
     count[1]++;
-  count[1] += (length >> 29);
+  count[1] += (uint4)(length >> 29);
  
   // number of bytes we need to fill in buffer
   size_type firstpart = 64 - index;
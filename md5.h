@@ -49,7 +49,7 @@ documentation and/or software.
 class MD5
 {
 public:
-    typedef unsigned int size_type; // must be 32bit
+    typedef std::size_t size_type;
 
     MD5();
     MD5(const std::string& text);
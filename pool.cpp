@@ -0,0 +1,123 @@
+#include "pool.h"
+
+// the pool the calling thread works for and its index there; one thread
+// only ever works for one pool, but may submit to others
+static thread_local const WorkPool* current_pool = NULL;
+static thread_local int current_worker = -1;
+
+WorkPool::WorkPool(unsigned n) : next(0), queued(0), pending(0), stopping(false)
+{
+    if (n == 0)
+        n = 1;
+
+    for (unsigned i = 0; i < n; i++)
+        queues.emplace_back(new queue);
+
+    for (unsigned i = 0; i < n; i++)
+        workers.emplace_back(&WorkPool::run, this, i);
+}
+
+WorkPool::~WorkPool()
+{
+    {
+        std::lock_guard<std::mutex> l(state_lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+
+    for (auto& w : workers)
+        w.join();
+}
+
+int WorkPool::worker_index() const
+{
+    return current_pool == this ? current_worker : -1;
+}
+
+void WorkPool::submit(task t)
+{
+    // tasks submitted from one of our workers stay on its own deque,
+    // everything else, a worker of another pool included, is dealt
+    // round-robin
+    int self = worker_index();
+    unsigned target = self >= 0 ? self : next++ % queues.size();
+
+    {
+        // the counters are bumped before the task becomes visible, so a
+        // thief can never decrement them ahead of us
+        std::lock_guard<std::mutex> l(state_lock);
+        queued++;
+        pending++;
+
+        std::lock_guard<std::mutex> q(queues[target]->lock);
+        queues[target]->tasks.push_back(std::move(t));
+    }
+    work_ready.notify_one();
+}
+
+void WorkPool::wait()
+{
+    std::unique_lock<std::mutex> l(state_lock);
+    all_done.wait(l, [this] { return pending == 0; });
+}
+
+bool WorkPool::pop(unsigned self, task& t)
+{
+    std::lock_guard<std::mutex> l(queues[self]->lock);
+
+    if (queues[self]->tasks.empty())
+        return false;
+
+    t = std::move(queues[self]->tasks.back());
+    queues[self]->tasks.pop_back();
+    return true;
+}
+
+bool WorkPool::steal(unsigned self, task& t)
+{
+    for (unsigned i = 1; i < queues.size(); i++)
+    {
+        queue& victim = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> l(victim.lock);
+
+        if (!victim.tasks.empty())
+        {
+            t = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkPool::run(unsigned self)
+{
+    current_pool = this;
+    current_worker = self;
+
+    for (;;)
+    {
+        task t;
+
+        if (pop(self, t) || steal(self, t))
+        {
+            {
+                std::lock_guard<std::mutex> l(state_lock);
+                queued--;
+            }
+
+            t();
+
+            std::lock_guard<std::mutex> l(state_lock);
+            if (--pending == 0)
+                all_done.notify_all();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> l(state_lock);
+        work_ready.wait(l, [this] { return stopping || queued > 0; });
+
+        if (stopping && queued == 0)
+            return;
+    }
+}
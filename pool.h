@@ -0,0 +1,62 @@
+#ifndef SWAG_POOL_H
+#define SWAG_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// a small work-stealing thread pool
+//
+// every worker owns a deque: it pops its own work from the back and,
+// when that runs dry, steals from the front of the other workers' deques.
+// submit() deals tasks round-robin over the deques, so a worker stuck on
+// a huge panorama doesn't hold up the files queued behind it.
+//
+// usage: 1) WorkPool pool(n)
+//        2) pool.submit(task) for every job
+//        3) pool.wait() blocks until every submitted task has run
+class WorkPool
+{
+public:
+    typedef std::function<void()> task;
+
+    explicit WorkPool(unsigned workers);
+    ~WorkPool();
+
+    void submit(task t);
+    void wait();
+    unsigned size() const { return workers.size(); }
+
+    // index of the calling worker thread in [0, size()), or -1 when the
+    // caller is not one of this pool's workers
+    int worker_index() const;
+
+private:
+    struct queue
+    {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    bool pop(unsigned self, task& t);
+    bool steal(unsigned self, task& t);
+    void run(unsigned self);
+
+    std::vector<std::unique_ptr<queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> next;
+
+    std::mutex state_lock;
+    std::condition_variable work_ready;
+    std::condition_variable all_done;
+    size_t queued;  // tasks sitting in the deques
+    size_t pending; // tasks submitted but not finished yet
+    bool stopping;
+};
+
+#endif
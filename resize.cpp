@@ -0,0 +1,548 @@
+#include "resize.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#ifdef SWAG_X86
+  #include <immintrin.h>
+#endif
+
+namespace Swag
+{
+    bool parse_filter(const std::string& name, resize_filter& filter)
+    {
+        static const resize_filter filters[] = {FILTER_BILINEAR, FILTER_BOX, FILTER_CATMULL_ROM, FILTER_LANCZOS3};
+
+        for (resize_filter f : filters)
+        {
+            if (name == filter_name(f))
+            {
+                filter = f;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char* filter_name(resize_filter filter)
+    {
+        switch (filter)
+        {
+        case FILTER_BOX:
+            return "box";
+        case FILTER_CATMULL_ROM:
+            return "catmull-rom";
+        case FILTER_LANCZOS3:
+            return "lanczos3";
+        default:
+            return "bilinear";
+        }
+    }
+
+    void resize_bilinear(unsigned num_components, unsigned output_width, unsigned output_height, unsigned out_width, unsigned out_height,
+                         const unsigned char* p, unsigned char* o)
+    {
+        double factor, fraction_x, fraction_y, one_minus_x, one_minus_y;
+        unsigned ceil_x, ceil_y, floor_x, floor_y, s_row_width;
+        unsigned tcx, tcy, tfx, tfy, tx, ty, t_row_width, x, y;
+
+        /* RGB images have 3 components, grayscale images have only one. */
+        s_row_width = num_components * output_width;
+        t_row_width = num_components * out_width;
+        factor = (double)output_width / (double)out_width;
+        for (y = 0; y < out_height; y++)
+        {
+            for (x = 0; x < out_width; x++)
+            {
+                floor_x = std::min((unsigned)(x * factor), output_width - 1);
+                floor_y = std::min((unsigned)(y * factor), output_height - 1);
+                ceil_x = (floor_x + 1 >= output_width) ? floor_x : floor_x + 1;
+                ceil_y = (floor_y + 1 >= output_height) ? floor_y : floor_y + 1;
+                fraction_x = (x * factor) - floor_x;
+                fraction_y = (y * factor) - floor_y;
+                one_minus_x = 1.0 - fraction_x;
+                one_minus_y = 1.0 - fraction_y;
+
+                tx = x * num_components;
+                ty = y * t_row_width;
+                tfx = floor_x * num_components;
+                tfy = floor_y * s_row_width;
+                tcx = ceil_x * num_components;
+                tcy = ceil_y * s_row_width;
+
+                o[tx + ty] = one_minus_y * (one_minus_x * p[tfx + tfy] + fraction_x * p[tcx + tfy]) +
+                            fraction_y * (one_minus_x * p[tfx + tcy] + fraction_x * p[tcx + tcy]);
+
+                if (num_components != 1)
+                {
+                    o[tx + ty + 1] = one_minus_y * (one_minus_x * p[tfx + tfy + 1] + fraction_x * p[tcx + tfy + 1]) +
+                                    fraction_y * (one_minus_x * p[tfx + tcy + 1] + fraction_x * p[tcx + tcy + 1]);
+
+                    o[tx + ty + 2] = one_minus_y * (one_minus_x * p[tfx + tfy + 2] + fraction_x * p[tcx + tfy + 2]) +
+                                    fraction_y * (one_minus_x * p[tfx + tcy + 2] + fraction_x * p[tcx + tcy + 2]);
+                }
+            }
+        }
+    }
+
+    // fixed-point weights carry 8 fractional bits, a blended sample
+    // (0..255 times a weight pair summing to 256) still fits in 16 bits
+    static const unsigned weight_one = 256;
+
+    // one axis worth of taps: element offsets of both neighbours and the
+    // weight of the second one
+    struct bilinear_taps
+    {
+        std::vector<unsigned> near;
+        std::vector<unsigned> far;
+        std::vector<unsigned short> weight;
+
+        bilinear_taps(unsigned source, unsigned target, double factor, unsigned stride)
+            : near(target), far(target), weight(target)
+        {
+            for (unsigned i = 0; i < target; i++)
+            {
+                unsigned f = std::min((unsigned)(i * factor), source - 1);
+                unsigned c = (f + 1 >= source) ? f : f + 1;
+                double fraction = (i * factor) - f;
+
+                near[i] = f * stride;
+                far[i] = c * stride;
+                weight[i] = (unsigned short)std::min((unsigned)(fraction * weight_one + 0.5), weight_one);
+            }
+        }
+    };
+
+    // v[i] = r0[i] * (256 - w) + r1[i] * w, for a whole source row
+    static void blend_rows_scalar(const unsigned char* r0, const unsigned char* r1, unsigned w, unsigned short* v, unsigned n,
+                                  unsigned i)
+    {
+        unsigned w0 = weight_one - w;
+
+        for (; i < n; i++)
+            v[i] = (unsigned short)(r0[i] * w0 + r1[i] * w);
+    }
+
+#ifdef SWAG_X86
+    static void blend_rows_sse2(const unsigned char* r0, const unsigned char* r1, unsigned w, unsigned short* v, unsigned n)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i vw0 = _mm_set1_epi16((short)(weight_one - w));
+        const __m128i vw1 = _mm_set1_epi16((short)w);
+        unsigned i = 0;
+
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(r0 + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(r1 + i));
+
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), vw0),
+                                       _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), vw1));
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), vw0),
+                                       _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), vw1));
+
+            _mm_storeu_si128((__m128i*)(v + i), lo);
+            _mm_storeu_si128((__m128i*)(v + i + 8), hi);
+        }
+
+        blend_rows_scalar(r0, r1, w, v, n, i);
+    }
+
+    __attribute__((target("avx2")))
+    static void blend_rows_avx2(const unsigned char* r0, const unsigned char* r1, unsigned w, unsigned short* v, unsigned n)
+    {
+        const __m256i vw0 = _mm256_set1_epi16((short)(weight_one - w));
+        const __m256i vw1 = _mm256_set1_epi16((short)w);
+        unsigned i = 0;
+
+        for (; i + 32 <= n; i += 32)
+        {
+            __m256i a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(r0 + i)));
+            __m256i b0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(r1 + i)));
+            __m256i a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(r0 + i + 16)));
+            __m256i b1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(r1 + i + 16)));
+
+            _mm256_storeu_si256((__m256i*)(v + i),
+                                _mm256_add_epi16(_mm256_mullo_epi16(a0, vw0), _mm256_mullo_epi16(b0, vw1)));
+            _mm256_storeu_si256((__m256i*)(v + i + 16),
+                                _mm256_add_epi16(_mm256_mullo_epi16(a1, vw0), _mm256_mullo_epi16(b1, vw1)));
+        }
+
+        blend_rows_scalar(r0, r1, w, v, n, i);
+    }
+#endif
+
+    // o[x] = (v[near] * (256 - w) + v[far] * w) >> 16, truncating like the
+    // double kernel does
+    static void blend_columns(unsigned num_components, const bilinear_taps& xt, const unsigned short* v, unsigned char* o,
+                              unsigned out_width)
+    {
+        for (unsigned x = 0; x < out_width; x++)
+        {
+            const unsigned short* a = v + xt.near[x];
+            const unsigned short* b = v + xt.far[x];
+            unsigned w1 = xt.weight[x];
+            unsigned w0 = weight_one - w1;
+
+            for (unsigned c = 0; c < num_components; c++)
+                *o++ = (unsigned char)((a[c] * w0 + b[c] * w1) >> 16);
+        }
+    }
+
+    static void blend_rows(simd_level level, const unsigned char* r0, const unsigned char* r1, unsigned w, unsigned short* v,
+                           unsigned n)
+    {
+        switch (level)
+        {
+#ifdef SWAG_X86
+        case SIMD_AVX2:
+            blend_rows_avx2(r0, r1, w, v, n);
+            break;
+        case SIMD_SSE2:
+            blend_rows_sse2(r0, r1, w, v, n);
+            break;
+#endif
+        default:
+            blend_rows_scalar(r0, r1, w, v, n, 0);
+            break;
+        }
+    }
+
+    void resize_bilinear_fixed(unsigned num_components, unsigned output_width, unsigned output_height, unsigned out_width, unsigned out_height,
+                               const unsigned char* p, unsigned char* o, simd_level level)
+    {
+        unsigned s_row_width = num_components * output_width;
+        unsigned t_row_width = num_components * out_width;
+        double factor = (double)output_width / (double)out_width;
+
+        // the reference kernel samples both axes with the horizontal factor
+        bilinear_taps xt(output_width, out_width, factor, num_components);
+        bilinear_taps yt(output_height, out_height, factor, s_row_width);
+        std::vector<unsigned short> v(s_row_width);
+
+        for (unsigned y = 0; y < out_height; y++)
+        {
+            const unsigned char* r0 = p + yt.near[y];
+            const unsigned char* r1 = p + yt.far[y];
+
+            blend_rows(level, r0, r1, yt.weight[y], v.data(), s_row_width);
+            blend_columns(num_components, xt, v.data(), o + y * t_row_width, out_width);
+        }
+    }
+
+    void resize_bilinear_fixed(unsigned num_components, unsigned output_width, unsigned output_height, unsigned out_width, unsigned out_height,
+                               const unsigned char* p, unsigned char* o)
+    {
+        static const simd_level level = detect_simd();
+
+        resize_bilinear_fixed(num_components, output_width, output_height, out_width, out_height, p, o, level);
+    }
+
+    // separable filters, x in source samples at scale 1
+    static double filter_support(resize_filter filter)
+    {
+        switch (filter)
+        {
+        case FILTER_CATMULL_ROM:
+            return 2.0;
+        case FILTER_LANCZOS3:
+            return 3.0;
+        default:
+            return 0.5;
+        }
+    }
+
+    static double filter_weight(resize_filter filter, double x)
+    {
+        x = fabs(x);
+
+        switch (filter)
+        {
+        case FILTER_CATMULL_ROM:
+            if (x < 1.0)
+                return (1.5 * x - 2.5) * x * x + 1.0;
+            if (x < 2.0)
+                return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+            return 0.0;
+
+        case FILTER_LANCZOS3:
+            if (x < 1e-8)
+                return 1.0;
+            if (x < 3.0)
+                return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+            return 0.0;
+
+        default:
+            return x <= 0.5 ? 1.0 : 0.0;
+        }
+    }
+
+    // weights carry 14 fractional bits: taps * 255 * weight stays well
+    // inside an int even for lanczos lobes above 1
+    static const int coefficient_bits = 14;
+
+    // every target sample reads count[i] source samples from start[i] on,
+    // with weights weight[i * taps ...]
+    struct coefficients
+    {
+        unsigned taps;
+        std::vector<unsigned> start;
+        std::vector<unsigned> count;
+        std::vector<int> weight;
+    };
+
+    static std::shared_ptr<const coefficients> build_coefficients(resize_filter filter, unsigned source, unsigned target)
+    {
+        std::shared_ptr<coefficients> c(new coefficients);
+        double scale = (double)source / (double)target;
+        double filter_scale = std::max(scale, 1.0);
+        double support = filter_support(filter) * filter_scale;
+        std::vector<double> w;
+
+        c->taps = (unsigned)ceil(support) * 2 + 1;
+        c->start.resize(target);
+        c->count.resize(target);
+        c->weight.assign(target * c->taps, 0);
+        w.resize(c->taps);
+
+        for (unsigned i = 0; i < target; i++)
+        {
+            double center = (i + 0.5) * scale;
+            int left = std::max(0, (int)floor(center - support));
+            int right = std::min((int)source, (int)ceil(center + support));
+            unsigned n = std::min((unsigned)std::max(right - left, 1), c->taps);
+            double sum = 0.0;
+
+            for (unsigned k = 0; k < n; k++)
+                sum += w[k] = filter_weight(filter, (left + k + 0.5 - center) / filter_scale);
+
+            // a tap window that only grazes the filter (upscaling the box)
+            // still has to produce something: take the nearest sample
+            if (sum == 0.0)
+            {
+                left = std::min((int)center, (int)source - 1);
+                n = 1;
+                w[0] = sum = 1.0;
+            }
+
+            int* fixed = &c->weight[i * c->taps];
+            int total = 0, largest = 0;
+            for (unsigned k = 0; k < n; k++)
+            {
+                fixed[k] = (int)lround(w[k] / sum * (1 << coefficient_bits));
+                total += fixed[k];
+                if (fixed[k] > fixed[largest])
+                    largest = k;
+            }
+
+            // rounding must not brighten or darken flat areas
+            fixed[largest] += (1 << coefficient_bits) - total;
+
+            c->start[i] = left;
+            c->count[i] = n;
+        }
+
+        return c;
+    }
+
+    // most batches come from a handful of cameras, so the same few
+    // geometries show up over and over
+    static std::shared_ptr<const coefficients> cached_coefficients(resize_filter filter, unsigned source, unsigned target)
+    {
+        static std::mutex lock;
+        static std::map<std::tuple<int, unsigned, unsigned>, std::shared_ptr<const coefficients>> cache;
+
+        auto key = std::make_tuple((int)filter, source, target);
+        std::lock_guard<std::mutex> l(lock);
+
+        auto it = cache.find(key);
+        if (it != cache.end())
+            return it->second;
+
+        if (cache.size() >= 256)
+            cache.clear();
+
+        return cache[key] = build_coefficients(filter, source, target);
+    }
+
+    static inline unsigned char clamp_sample(int v)
+    {
+        v >>= coefficient_bits;
+        return (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+    }
+
+    // one row of the horizontal pass, all components of a pixel are
+    // accumulated together so every tap is read once
+    template <unsigned N>
+    static void filter_row(const coefficients& xc, const unsigned char* s, unsigned char* o, unsigned out_width)
+    {
+        for (unsigned x = 0; x < out_width; x++)
+        {
+            const unsigned char* taps = s + xc.start[x] * N;
+            const int* w = &xc.weight[x * xc.taps];
+            int acc[N];
+
+            for (unsigned c = 0; c < N; c++)
+                acc[c] = 1 << (coefficient_bits - 1);
+
+            for (unsigned k = 0; k < xc.count[x]; k++, taps += N)
+                for (unsigned c = 0; c < N; c++)
+                    acc[c] += w[k] * taps[c];
+
+            for (unsigned c = 0; c < N; c++)
+                *o++ = clamp_sample(acc[c]);
+        }
+    }
+
+    static void filter_row(unsigned num_components, const coefficients& xc, const unsigned char* s, unsigned char* o,
+                           unsigned out_width)
+    {
+        switch (num_components)
+        {
+        case 1:
+            filter_row<1>(xc, s, o, out_width);
+            break;
+        case 3:
+            filter_row<3>(xc, s, o, out_width);
+            break;
+        case 4:
+            filter_row<4>(xc, s, o, out_width);
+            break;
+        default:
+            for (unsigned c = 0; c < num_components; c++)
+                for (unsigned x = 0; x < out_width; x++)
+                {
+                    const unsigned char* taps = s + xc.start[x] * num_components + c;
+                    const int* w = &xc.weight[x * xc.taps];
+                    int acc = 1 << (coefficient_bits - 1);
+
+                    for (unsigned k = 0; k < xc.count[x]; k++)
+                        acc += w[k] * taps[k * num_components];
+
+                    o[x * num_components + c] = clamp_sample(acc);
+                }
+            break;
+        }
+    }
+
+    row_resizer::row_resizer(resize_filter filter, unsigned num_components, unsigned source_width, unsigned source_height,
+                             unsigned target_width, unsigned target_height, row_sink emit)
+        : num_components(num_components), target_width(target_width), target_height(target_height), pushed(0), emitted(0),
+          emit(emit)
+    {
+        // bilinear samples like resize_bilinear_fixed, both axes with the
+        // horizontal factor and the same 8 bit blends, so a streamed
+        // thumbnail has the pixels of a whole-frame one. only the last two
+        // source rows are kept
+        if (filter == FILTER_BILINEAR)
+        {
+            double factor = (double)source_width / (double)target_width;
+
+            source_row_width = source_width * num_components;
+            bx.reset(new bilinear_taps(source_width, target_width, factor, num_components));
+            by.reset(new bilinear_taps(source_height, target_height, factor, 1));
+            window = 2;
+            rows.resize(window * source_row_width);
+            blend.resize(source_row_width);
+            out.resize(target_width * num_components);
+            return;
+        }
+
+        xc = cached_coefficients(filter, source_width, target_width);
+        yc = cached_coefficients(filter, source_height, target_height);
+
+        // a target row is finished as soon as its last tap arrives, so at
+        // most one tap window of horizontally filtered rows is ever alive
+        window = yc->taps;
+        rows.resize(window * target_width * num_components);
+        acc.resize(target_width * num_components);
+        out.resize(target_width * num_components);
+    }
+
+    void row_resizer::push(const unsigned char* row)
+    {
+        unsigned t_row_width = target_width * num_components;
+
+        if (by)
+        {
+            static const simd_level level = detect_simd();
+
+            memcpy(&rows[(pushed % window) * source_row_width], row, source_row_width);
+            pushed++;
+
+            while (emitted < target_height && by->far[emitted] < pushed)
+            {
+                const unsigned char* r0 = &rows[(by->near[emitted] % window) * source_row_width];
+                const unsigned char* r1 = &rows[(by->far[emitted] % window) * source_row_width];
+
+                blend_rows(level, r0, r1, by->weight[emitted], blend.data(), source_row_width);
+                blend_columns(num_components, *bx, blend.data(), out.data(), target_width);
+
+                emit(out.data());
+                emitted++;
+            }
+            return;
+        }
+
+        filter_row(num_components, *xc, row, &rows[(pushed % window) * t_row_width], target_width);
+        pushed++;
+
+        while (emitted < target_height && yc->start[emitted] + yc->count[emitted] <= pushed)
+        {
+            const int* w = &yc->weight[emitted * yc->taps];
+
+            // the vertical pass walks whole intermediate rows, which keeps
+            // the inner loop contiguous and lets the compiler vectorize it
+            std::fill(acc.begin(), acc.end(), 1 << (coefficient_bits - 1));
+            for (unsigned k = 0; k < yc->count[emitted]; k++)
+            {
+                const unsigned char* r = &rows[((yc->start[emitted] + k) % window) * t_row_width];
+                int wk = w[k];
+
+                for (unsigned i = 0; i < t_row_width; i++)
+                    acc[i] += wk * r[i];
+            }
+
+            for (unsigned i = 0; i < t_row_width; i++)
+                out[i] = clamp_sample(acc[i]);
+
+            emit(out.data());
+            emitted++;
+        }
+    }
+
+    size_t row_resizer::footprint() const
+    {
+        return rows.size() + acc.size() * sizeof(int) + blend.size() * sizeof(unsigned short) + out.size();
+    }
+
+    void resize_separable(resize_filter filter, unsigned num_components, unsigned output_width, unsigned output_height,
+                          unsigned out_width, unsigned out_height, const unsigned char* p, unsigned char* o)
+    {
+        unsigned s_row_width = num_components * output_width;
+        unsigned t_row_width = num_components * out_width;
+
+        row_resizer r(filter, num_components, output_width, output_height, out_width, out_height, [&](const unsigned char* row) {
+            memcpy(o, row, t_row_width);
+            o += t_row_width;
+        });
+
+        for (unsigned y = 0; y < output_height; y++)
+            r.push(p + y * s_row_width);
+    }
+
+    void resize(resize_filter filter, unsigned num_components, unsigned output_width, unsigned output_height, unsigned out_width,
+                unsigned out_height, const unsigned char* p, unsigned char* o)
+    {
+        if (filter == FILTER_BILINEAR)
+            resize_bilinear_fixed(num_components, output_width, output_height, out_width, out_height, p, o);
+        else
+            resize_separable(filter, num_components, output_width, output_height, out_width, out_height, p, o);
+    }
+} // namespace Swag
@@ -0,0 +1,96 @@
+#ifndef SWAG_RESIZE_H
+#define SWAG_RESIZE_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "simd.h"
+
+namespace Swag
+{
+    enum resize_filter
+    {
+        FILTER_BILINEAR,
+        FILTER_BOX,
+        FILTER_CATMULL_ROM,
+        FILTER_LANCZOS3
+    };
+
+    // "bilinear", "box", "catmull-rom" or "lanczos3"
+    bool parse_filter(const std::string& name, resize_filter& filter);
+    const char* filter_name(resize_filter filter);
+
+    // double precision reference kernel, kept to check the fast one against
+    void resize_bilinear(unsigned num_components, unsigned output_width, unsigned output_height, unsigned out_width, unsigned out_height,
+                         const unsigned char* p, unsigned char* o);
+
+    // same sampling as resize_bilinear, but with 8 bit fixed-point weights
+    // from tap tables built once per call. the vertical blend runs over
+    // whole rows with SSE2/AVX2, picked at runtime unless level is given
+    void resize_bilinear_fixed(unsigned num_components, unsigned output_width, unsigned output_height, unsigned out_width, unsigned out_height,
+                               const unsigned char* p, unsigned char* o);
+    void resize_bilinear_fixed(unsigned num_components, unsigned output_width, unsigned output_height, unsigned out_width, unsigned out_height,
+                               const unsigned char* p, unsigned char* o, simd_level level);
+
+    // two pass resampler: horizontal into 8 bit rows, then vertical. the
+    // filter is widened by the scale factor when shrinking, so box averages
+    // the covered area and nothing aliases. coefficient tables are cached
+    // per (filter, source, target) length and shared by every image of the
+    // same geometry
+    void resize_separable(resize_filter filter, unsigned num_components, unsigned output_width, unsigned output_height,
+                          unsigned out_width, unsigned out_height, const unsigned char* p, unsigned char* o);
+
+    struct coefficients;
+    struct bilinear_taps;
+
+    // streaming form of resize_separable: source rows are pushed top to
+    // bottom, each one is filtered horizontally on arrival and every target
+    // row is handed to emit as soon as its last vertical tap is in. only one
+    // window of taps is kept, never the whole frame. bilinear keeps the
+    // last two source rows instead and gives resize_bilinear_fixed's pixels
+    class row_resizer
+    {
+    public:
+        typedef std::function<void(const unsigned char* row)> row_sink;
+
+        row_resizer(resize_filter filter, unsigned num_components, unsigned source_width, unsigned source_height,
+                    unsigned target_width, unsigned target_height, row_sink emit);
+
+        void push(const unsigned char* row);
+        bool finished() const { return emitted == target_height; }
+
+        // bytes held by the tap window and the row buffers
+        size_t footprint() const;
+
+    private:
+        unsigned num_components;
+        unsigned target_width;
+        unsigned target_height;
+        unsigned window;
+        unsigned pushed;
+        unsigned emitted;
+        row_sink emit;
+
+        std::shared_ptr<const coefficients> xc;
+        std::shared_ptr<const coefficients> yc;
+        std::vector<unsigned char> rows;
+        std::vector<int> acc;
+        std::vector<unsigned char> out;
+
+        // FILTER_BILINEAR only: taps in pixels across, rows down
+        std::shared_ptr<const bilinear_taps> bx;
+        std::shared_ptr<const bilinear_taps> by;
+        unsigned source_row_width = 0;
+        std::vector<unsigned short> blend;
+    };
+
+    // FILTER_BILINEAR goes to resize_bilinear_fixed, the rest to
+    // resize_separable
+    void resize(resize_filter filter, unsigned num_components, unsigned output_width, unsigned output_height, unsigned out_width,
+                unsigned out_height, const unsigned char* p, unsigned char* o);
+} // namespace Swag
+
+#endif
@@ -0,0 +1,143 @@
+#include "scan.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+// what getdents64 fills the buffer with; glibc doesn't declare it
+struct linux_dirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+Scanner::Scanner(unsigned threads, const std::vector<std::string>& extensions)
+    : pool(threads), extensions(extensions), root_fd(-1)
+{
+}
+
+bool Scanner::wanted(const char* name, size_t length) const
+{
+    for (auto& ext : extensions)
+        if (length > ext.size() && strcasecmp(name + length - ext.size(), ext.c_str()) == 0)
+            return true;
+    return false;
+}
+
+void Scanner::read_directory(node* n)
+{
+    Swag::stage_timer timer(Swag::STAGE_WALK);
+    std::vector<std::string> subdirs;
+    int fd = openat(root_fd, n->path.empty() ? "." : n->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0)
+        std::cout << "Could not open " << n->path << ": " << strerror(errno) << std::endl;
+
+    static thread_local std::vector<char> buffer(1 << 16);
+    long got;
+
+    while (fd >= 0 && (got = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0)
+    {
+        for (long at = 0; at < got;)
+        {
+            linux_dirent64* d = (linux_dirent64*)(buffer.data() + at);
+            const char* name = d->d_name;
+            unsigned char type = d->d_type;
+
+            at += d->d_reclen;
+
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                continue;
+
+            // not every filesystem fills d_type in
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+                    type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+            }
+
+            if (type == DT_DIR)
+            {
+                if (strcmp(name, "thumbs") != 0)
+                    subdirs.push_back(name);
+            }
+            else if (wanted(name, strlen(name)))
+                n->files.push_back(name);
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+
+    std::sort(n->files.begin(), n->files.end());
+    std::sort(subdirs.begin(), subdirs.end());
+
+    for (auto& s : subdirs)
+    {
+        n->children.emplace_back(new node);
+        n->children.back()->path = n->path.empty() ? s : n->path + "/" + s;
+    }
+
+    // workers take their newest task first, so hand the children over
+    // last to first and the first one is read next, as the sink wants it
+    for (auto it = n->children.rbegin(); it != n->children.rend(); ++it)
+    {
+        node* child = it->get();
+        pool.submit([this, child] { read_directory(child); });
+    }
+
+    {
+        std::lock_guard<std::mutex> l(lock);
+        n->ready = true;
+    }
+    ready.notify_all();
+}
+
+void Scanner::visit(node* n, const batch_sink& sink)
+{
+    {
+        std::unique_lock<std::mutex> l(lock);
+        ready.wait(l, [n] { return n->ready; });
+    }
+
+    sink(batch{n->path, std::move(n->files)});
+
+    for (auto& child : n->children)
+    {
+        visit(child.get(), sink);
+        child.reset();
+    }
+}
+
+bool Scanner::scan(const std::string& root, const batch_sink& sink)
+{
+    if ((root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    {
+        std::cout << "Could not open " << root << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    node top;
+    pool.submit([this, &top] { read_directory(&top); });
+    visit(&top, sink);
+
+    pool.wait();
+    close(root_fd);
+    root_fd = -1;
+
+    return true;
+}
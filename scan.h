@@ -0,0 +1,65 @@
+#ifndef SWAG_SCAN_H
+#define SWAG_SCAN_H
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "pool.h"
+
+// parallel directory walk on openat/getdents64
+//
+// directories are read on a pool of their own, many at a time, which is
+// what hides the latency of network storage. entry types come from d_type,
+// so nothing is stat'ed unless the filesystem leaves it out, and names are
+// matched against the wanted extensions before a string is ever built.
+// directories called "thumbs" are not entered.
+//
+// results come back on the calling thread as one sorted batch per
+// directory, in a fixed order (a directory's files, then each
+// subdirectory in name order), while the pool keeps reading ahead.
+//
+// usage: 1) Scanner scanner(threads, {".jpg", ".png"})
+//        2) scanner.scan(root, sink), sink is called once per directory
+class Scanner
+{
+public:
+    struct batch
+    {
+        std::string dir;                // relative to root, "" for root itself
+        std::vector<std::string> files; // names only, sorted
+    };
+
+    typedef std::function<void(const batch&)> batch_sink;
+
+    // extensions are lowercase and include the dot; matching ignores case
+    Scanner(unsigned threads, const std::vector<std::string>& extensions);
+
+    // false when root can't be opened
+    bool scan(const std::string& root, const batch_sink& sink);
+
+private:
+    struct node
+    {
+        std::string path;
+        bool ready = false;
+        std::vector<std::string> files;
+        std::vector<std::unique_ptr<node>> children;
+    };
+
+    void read_directory(node* n);
+    void visit(node* n, const batch_sink& sink);
+    bool wanted(const char* name, size_t length) const;
+
+    WorkPool pool;
+    std::vector<std::string> extensions;
+    int root_fd;
+
+    std::mutex lock;
+    std::condition_variable ready;
+};
+
+#endif
@@ -0,0 +1,662 @@
+#include "serve.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "thumbnail.h"
+
+// longest request head we wait for before giving up on a client
+static const size_t max_head = 16384;
+// unread requests a client may queue behind one that is still being
+// answered; past that many heads' worth the connection is dropped
+static const size_t max_pipelined = 4;
+
+struct Server::connection
+{
+    int fd;
+    uint64_t id;
+    std::string in;
+    bool keep_alive = true;
+    bool http10 = false;    // keep-alive has to be said out loud
+    bool waiting = false;   // for a thumbnail
+    bool writable = false;  // EPOLLOUT armed
+
+    // the response: head (and small bodies), then a cached blob or a file
+    std::string out;
+    size_t out_sent = 0;
+    blob body;
+    size_t body_sent = 0;
+    int file = -1;
+    off_t file_offset = 0;
+    size_t file_left = 0;
+
+    bool sending() const { return out_sent < out.size() || body || file >= 0; }
+
+    // the end of a response head, telling the client whether the
+    // connection stays open
+    const char* head_end() const
+    {
+        if (!keep_alive)
+            return "\r\nConnection: close\r\n\r\n";
+        return http10 ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\n\r\n";
+    }
+};
+
+static const char* status_text(int status)
+{
+    switch (status)
+    {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 431: return "Request Header Fields Too Large";
+    default: return "Internal Server Error";
+    }
+}
+
+static const char* content_type(const std::string& path)
+{
+    size_t dot = path.rfind('.');
+    std::string ext = dot == std::string::npos ? "" : path.substr(dot);
+
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == ".html")
+        return "text/html; charset=utf-8";
+    if (ext == ".js")
+        return "application/javascript; charset=utf-8";
+    if (ext == ".jpg" || ext == ".jpeg")
+        return "image/jpeg";
+    if (ext == ".png")
+        return "image/png";
+    return "application/octet-stream";
+}
+
+// %xx escapes undone and the query dropped; false for anything that could
+// leave basepath
+static bool decode_path(const std::string& target, std::string& path)
+{
+    std::string raw = target.substr(0, target.find('?'));
+
+    path.clear();
+    for (size_t i = 0; i < raw.size(); i++)
+    {
+        if (raw[i] == '%' && i + 2 < raw.size() && isxdigit((unsigned char)raw[i + 1]) && isxdigit((unsigned char)raw[i + 2]))
+        {
+            path += (char)std::stoi(raw.substr(i + 1, 2), NULL, 16);
+            i += 2;
+        }
+        else
+            path += raw[i];
+    }
+
+    if (path.empty() || path[0] != '/' || path.find('\0') != std::string::npos)
+        return false;
+
+    for (size_t at = 0; (at = path.find("/..", at)) != std::string::npos; at++)
+        if (at + 3 == path.size() || path[at + 3] == '/')
+            return false;
+
+    if (path == "/")
+        path = "/index.html";
+    return true;
+}
+
+Server::Server(const std::string& basepath, source_map thumbnails, unsigned workers, size_t cache_bytes)
+    : basepath(basepath), thumbnails(std::move(thumbnails)), pool(workers), cache_limit(cache_bytes)
+{
+}
+
+Server::~Server()
+{
+    pool.wait();
+
+    for (auto& c : connections)
+    {
+        if (c.second->file >= 0)
+            close(c.second->file);
+        close(c.first);
+    }
+
+    for (int fd : {listen_fd, epoll_fd, event_fd})
+        if (fd >= 0)
+            close(fd);
+}
+
+bool Server::listen(const std::string& address, unsigned port)
+{
+    sockaddr_in addr = {};
+    int on = 1;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+    {
+        std::cout << "Not an IPv4 address: " << address << std::endl;
+        return false;
+    }
+
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listen_fd, SOMAXCONN) != 0)
+    {
+        std::cout << "Could not listen on " << address << ":" << port << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || event_fd < 0)
+    {
+        std::cout << "Could not set up epoll: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    for (int fd : {listen_fd, event_fd})
+    {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    return true;
+}
+
+bool Server::run()
+{
+    epoll_event events[256];
+
+    for (;;)
+    {
+        int n = epoll_wait(epoll_fd, events, 256, -1);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cout << "epoll_wait failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        for (int e = 0; e < n; e++)
+        {
+            int fd = events[e].data.fd;
+
+            if (fd == listen_fd)
+            {
+                accept_connections();
+                continue;
+            }
+
+            if (fd == event_fd)
+            {
+                uint64_t count;
+                while (read(event_fd, &count, sizeof(count)) > 0)
+                    ;
+                finish_renderings();
+                continue;
+            }
+
+            // an earlier event in this round may have closed it
+            auto it = connections.find(fd);
+            if (it == connections.end())
+                continue;
+            connection& c = *it->second;
+
+            if (events[e].events & (EPOLLERR | EPOLLHUP))
+                drop(c);
+            else if (events[e].events & EPOLLIN)
+                read_requests(c);
+            else if ((events[e].events & EPOLLOUT) && flush(c))
+                serve_requests(c);
+        }
+    }
+}
+
+void Server::accept_connections()
+{
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        std::unique_ptr<connection> c(new connection);
+        c->fd = fd;
+        c->id = next_id++;
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+
+        connections[fd] = std::move(c);
+    }
+}
+
+void Server::read_requests(connection& c)
+{
+    char buffer[16384];
+    ssize_t got;
+
+    while ((got = recv(c.fd, buffer, sizeof(buffer), 0)) > 0)
+    {
+        c.in.append(buffer, got);
+
+        // the head limit is only checked once earlier responses are out,
+        // so a client that keeps writing meanwhile is cut off here
+        if (c.in.size() > max_head * max_pipelined)
+        {
+            drop(c);
+            return;
+        }
+    }
+
+    if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        drop(c);
+        return;
+    }
+
+    // one response at a time, later requests wait in c.in
+    if (!c.waiting && !c.sending())
+        serve_requests(c);
+}
+
+void Server::serve_requests(connection& c)
+{
+    while (!c.waiting && !c.sending())
+    {
+        size_t end = c.in.find("\r\n\r\n");
+
+        if (end == std::string::npos)
+        {
+            if (c.in.size() > max_head)
+            {
+                c.keep_alive = false;
+                send_error(c, 431);
+                flush(c);
+            }
+            return;
+        }
+
+        std::string head = c.in.substr(0, end);
+        c.in.erase(0, end + 4);
+
+        handle(c, head);
+        if (!flush(c))
+            return;
+    }
+}
+
+void Server::handle(connection& c, const std::string& head)
+{
+    size_t line_end = head.find("\r\n");
+    std::string line = head.substr(0, line_end);
+    size_t sp1 = line.find(' '), sp2 = line.rfind(' ');
+
+    if (sp1 == std::string::npos || sp2 == sp1)
+    {
+        c.keep_alive = false;
+        send_error(c, 400);
+        return;
+    }
+
+    std::string method = line.substr(0, sp1);
+    std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    std::string version = line.substr(sp2 + 1);
+    std::string headers = line_end == std::string::npos ? "" : head.substr(line_end);
+    std::string path;
+
+    std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+    c.http10 = version != "HTTP/1.1";
+    if (!c.http10)
+        c.keep_alive = headers.find("\r\nconnection: close") == std::string::npos;
+    else
+        c.keep_alive = headers.find("\r\nconnection: keep-alive") != std::string::npos;
+
+    // no bodies are read, so nothing that could carry one is served
+    if (method != "GET" && method != "HEAD")
+    {
+        c.keep_alive = false;
+        send_error(c, 405);
+        return;
+    }
+
+    if (!decode_path(target, path))
+    {
+        send_error(c, 400);
+        return;
+    }
+
+    if (thumbnails.count(path))
+        send_thumbnail(c, path, method == "HEAD");
+    else
+        send_file(c, path, method == "HEAD");
+}
+
+void Server::send_thumbnail(connection& c, const std::string& path, bool head)
+{
+    if (blob body = cached(path))
+    {
+        send_blob(c, body, head);
+        return;
+    }
+
+    const thumbnail_source& source = thumbnails[path];
+    auto queued = pending.find(source.thumb);
+
+    c.waiting = true;
+    if (queued != pending.end())
+    {
+        queued->second.push_back(waiter{c.fd, c.id, path, head});
+        return;
+    }
+
+    pending[source.thumb].push_back(waiter{c.fd, c.id, path, head});
+
+    std::string thumb = source.thumb, picture = source.picture;
+    pool.submit([this, thumb, picture] { render(thumb, picture); });
+}
+
+void Server::send_file(connection& c, const std::string& path, bool head)
+{
+    std::string filename = basepath + path;
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        if (fd >= 0)
+            close(fd);
+        send_error(c, 404);
+        return;
+    }
+
+    c.out = "HTTP/1.1 200 OK\r\nContent-Type: " + std::string(content_type(path)) +
+            "\r\nContent-Length: " + std::to_string(st.st_size) + c.head_end();
+    c.out_sent = 0;
+
+    if (head || st.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+
+    c.file = fd;
+    c.file_offset = 0;
+    c.file_left = st.st_size;
+}
+
+void Server::send_blob(connection& c, const blob& body, bool head)
+{
+    c.out = "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(body->size()) +
+            c.head_end();
+    c.out_sent = 0;
+
+    if (!head && !body->empty())
+    {
+        c.body = body;
+        c.body_sent = 0;
+    }
+}
+
+void Server::send_error(connection& c, int status)
+{
+    std::string text = std::to_string(status) + " " + status_text(status) + "\n";
+
+    c.out = "HTTP/1.1 " + std::to_string(status) + " " + status_text(status) +
+            "\r\nContent-Type: text/plain\r\nContent-Length: " + std::to_string(text.size()) +
+            c.head_end() + text;
+    c.out_sent = 0;
+}
+
+// push out as much of the response as the socket takes. false when the
+// connection is gone, either on an error or after its last response
+bool Server::flush(connection& c)
+{
+    bool failed = false;
+
+    while (!failed && c.out_sent < c.out.size())
+    {
+        ssize_t n = send(c.fd, c.out.data() + c.out_sent, c.out.size() - c.out_sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            failed = errno != EAGAIN && errno != EWOULDBLOCK;
+            break;
+        }
+        c.out_sent += n;
+    }
+
+    while (!failed && c.out_sent == c.out.size() && c.body && c.body_sent < c.body->size())
+    {
+        ssize_t n = send(c.fd, c.body->data() + c.body_sent, c.body->size() - c.body_sent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            failed = errno != EAGAIN && errno != EWOULDBLOCK;
+            break;
+        }
+        c.body_sent += n;
+    }
+
+    while (!failed && c.out_sent == c.out.size() && !c.body && c.file >= 0 && c.file_left > 0)
+    {
+        ssize_t n = sendfile(c.fd, c.file, &c.file_offset, c.file_left);
+        if (n <= 0)
+        {
+            // 0 is a file that got shorter since we sent its length
+            failed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+        c.file_left -= n;
+    }
+
+    if (failed)
+    {
+        drop(c);
+        return false;
+    }
+
+    if (c.body && c.body_sent == c.body->size())
+        c.body.reset();
+
+    if (c.file >= 0 && c.file_left == 0)
+    {
+        close(c.file);
+        c.file = -1;
+    }
+
+    bool more = c.sending();
+    if (!more)
+    {
+        c.out.clear();
+        c.out_sent = 0;
+
+        if (!c.keep_alive)
+        {
+            drop(c);
+            return false;
+        }
+    }
+
+    // wait for room in the socket buffer only while there is something to send
+    if (more != c.writable)
+    {
+        epoll_event ev = {};
+        ev.events = more ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.fd = c.fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+        c.writable = more;
+    }
+
+    return true;
+}
+
+void Server::drop(connection& c)
+{
+    int fd = c.fd;
+
+    if (c.file >= 0)
+        close(c.file);
+    close(fd);
+    connections.erase(fd);
+}
+
+// on a worker: the thumbnail from disk when it is newer than the picture,
+// otherwise decoded and written out again
+void Server::render(const std::string& thumb, const std::string& picture)
+{
+    std::vector<std::string> outputs = Swag::thumbnail_filenames(thumb, Swag::command_line_options());
+    rendering r;
+    struct stat src, st;
+
+    r.thumb = thumb;
+
+    bool fresh = stat(picture.c_str(), &src) == 0;
+    for (auto& o : outputs)
+        fresh = fresh && stat((basepath + o).c_str(), &st) == 0 &&
+                (st.st_mtim.tv_sec > src.st_mtim.tv_sec ||
+                 (st.st_mtim.tv_sec == src.st_mtim.tv_sec && st.st_mtim.tv_nsec >= src.st_mtim.tv_nsec));
+
+    for (size_t l = 0; fresh && l < outputs.size(); l++)
+    {
+        FILE* f = fopen((basepath + outputs[l]).c_str(), "rb");
+        std::shared_ptr<std::vector<unsigned char>> data(new std::vector<unsigned char>);
+        unsigned char chunk[65536];
+        size_t n;
+
+        if (!f)
+        {
+            fresh = false;
+            break;
+        }
+
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+            data->insert(data->end(), chunk, chunk + n);
+
+        fresh = !ferror(f) && !data->empty();
+        fclose(f);
+        r.files.emplace_back(outputs[l], data);
+    }
+
+    if (!fresh)
+    {
+        std::vector<std::vector<unsigned char>> encoded;
+        image i;
+
+        r.files.clear();
+        i.in_filename = picture;
+        i.out_filename = basepath + thumb;
+        i.encoded = &encoded;
+
+        std::cout << "Generating thumbnail: " << picture << std::endl;
+        if (Swag::generate_thumbnail(&i) && encoded.size() == outputs.size())
+            for (size_t l = 0; l < outputs.size(); l++)
+                r.files.emplace_back(outputs[l], std::make_shared<const std::vector<unsigned char>>(std::move(encoded[l])));
+    }
+
+    {
+        std::lock_guard<std::mutex> l(done_lock);
+        done.push_back(std::move(r));
+    }
+
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0)
+        std::cout << "Could not wake the server: " << strerror(errno) << std::endl;
+}
+
+// on the loop: cache what the workers made and answer whoever waited for it
+void Server::finish_renderings()
+{
+    std::vector<rendering> finished;
+
+    {
+        std::lock_guard<std::mutex> l(done_lock);
+        finished.swap(done);
+    }
+
+    for (auto& r : finished)
+    {
+        for (auto& f : r.files)
+            cache(f.first, f.second);
+
+        auto queued = pending.find(r.thumb);
+        if (queued == pending.end())
+            continue;
+
+        std::vector<waiter> waiters = std::move(queued->second);
+        pending.erase(queued);
+
+        for (auto& w : waiters)
+        {
+            auto it = connections.find(w.fd);
+            // gone, or the descriptor already belongs to someone else
+            if (it == connections.end() || it->second->id != w.id)
+                continue;
+
+            connection& c = *it->second;
+            auto file = std::find_if(r.files.begin(), r.files.end(), [&](const std::pair<std::string, blob>& f) { return f.first == w.path; });
+
+            c.waiting = false;
+            if (file == r.files.end())
+                send_error(c, 500);
+            else
+                send_blob(c, file->second, w.head);
+
+            if (flush(c))
+                serve_requests(c);
+        }
+    }
+}
+
+Server::blob Server::cached(const std::string& path)
+{
+    auto it = lru_index.find(path);
+
+    if (it == lru_index.end())
+        return blob();
+
+    lru.splice(lru.end(), lru, it->second);
+    return it->second->second;
+}
+
+void Server::cache(const std::string& path, const blob& body)
+{
+    auto it = lru_index.find(path);
+
+    if (it != lru_index.end())
+    {
+        cache_used -= it->second->second->size();
+        lru.erase(it->second);
+        lru_index.erase(it);
+    }
+
+    if (body->size() > cache_limit)
+        return;
+
+    while (cache_used + body->size() > cache_limit)
+    {
+        cache_used -= lru.front().second->size();
+        lru_index.erase(lru.front().first);
+        lru.pop_front();
+    }
+
+    lru.emplace_back(path, body);
+    lru_index[path] = std::prev(lru.end());
+    cache_used += body->size();
+}
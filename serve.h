@@ -0,0 +1,113 @@
+#ifndef SWAG_SERVE_H
+#define SWAG_SERVE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pool.h"
+
+// http server behind "main serve"
+//
+// index.html, the gallery pages and the pictures are plain files under
+// basepath and go out with sendfile(). thumbnails are only made when a
+// browser first asks for one: a worker decodes the picture, writes every
+// size to thumbs/ as a normal run would and hands the encoded files back,
+// and those stay in an LRU cache bounded in bytes. a thumbnail already on
+// disk and newer than its picture is read instead of decoded. requests for
+// a thumbnail that is being made wait on that same job, so a page opened
+// by many browsers at once still decodes each picture once.
+//
+// a single thread runs every connection on an epoll loop (GET and HEAD,
+// keep-alive and pipelining), the workers never touch a socket and the
+// loop never decodes or waits on a worker.
+//
+// usage: 1) Server server(basepath, thumbnails, workers, cache_bytes)
+//        2) server.listen(address, port)
+//        3) server.run(), only returns when epoll fails
+class Server
+{
+public:
+    // the picture a thumbnail path (relative to basepath, any of its sizes)
+    // is made from, and the path of its main thumbnail
+    struct thumbnail_source
+    {
+        std::string picture;
+        std::string thumb;
+    };
+
+    typedef std::unordered_map<std::string, thumbnail_source> source_map;
+    typedef std::shared_ptr<const std::vector<unsigned char>> blob;
+
+    Server(const std::string& basepath, source_map thumbnails, unsigned workers, size_t cache_bytes);
+    ~Server();
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    bool listen(const std::string& address, unsigned port);
+    bool run();
+
+private:
+    struct connection;
+
+    // a request parked until its thumbnail is ready
+    struct waiter
+    {
+        int fd;
+        uint64_t id;
+        std::string path;
+        bool head;
+    };
+
+    // what a worker hands back: every size of one thumbnail, empty when
+    // the picture couldn't be decoded
+    struct rendering
+    {
+        std::string thumb;
+        std::vector<std::pair<std::string, blob>> files;
+    };
+
+    void accept_connections();
+    void read_requests(connection& c);
+    void serve_requests(connection& c);
+    void handle(connection& c, const std::string& head);
+    void send_thumbnail(connection& c, const std::string& path, bool head);
+    void send_file(connection& c, const std::string& path, bool head);
+    void send_blob(connection& c, const blob& body, bool head);
+    void send_error(connection& c, int status);
+    bool flush(connection& c);
+    void drop(connection& c);
+
+    void render(const std::string& thumb, const std::string& picture);
+    void finish_renderings();
+
+    blob cached(const std::string& path);
+    void cache(const std::string& path, const blob& body);
+
+    std::string basepath;
+    source_map thumbnails;
+    WorkPool pool;
+
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int event_fd = -1;
+    uint64_t next_id = 0;
+    std::unordered_map<int, std::unique_ptr<connection>> connections;
+    std::unordered_map<std::string, std::vector<waiter>> pending;
+
+    // least recently used first
+    std::list<std::pair<std::string, blob>> lru;
+    std::unordered_map<std::string, std::list<std::pair<std::string, blob>>::iterator> lru_index;
+    size_t cache_used = 0;
+    size_t cache_limit;
+
+    std::mutex done_lock;
+    std::vector<rendering> done;
+};
+
+#endif
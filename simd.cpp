@@ -0,0 +1,29 @@
+#include "simd.h"
+
+namespace Swag
+{
+    simd_level detect_simd()
+    {
+#ifdef SWAG_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return SIMD_AVX2;
+        if (__builtin_cpu_supports("sse2"))
+            return SIMD_SSE2;
+#endif
+        return SIMD_NONE;
+    }
+
+    const char* simd_name(simd_level level)
+    {
+        switch (level)
+        {
+        case SIMD_AVX2:
+            return "avx2";
+        case SIMD_SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+        }
+    }
+} // namespace Swag
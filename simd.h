@@ -0,0 +1,22 @@
+#ifndef SWAG_SIMD_H
+#define SWAG_SIMD_H
+
+#if defined(__x86_64__) || defined(__i386__)
+  #define SWAG_X86 1
+#endif
+
+namespace Swag
+{
+    enum simd_level
+    {
+        SIMD_NONE,
+        SIMD_SSE2,
+        SIMD_AVX2
+    };
+
+    // best instruction set the running CPU supports
+    simd_level detect_simd();
+    const char* simd_name(simd_level level);
+} // namespace Swag
+
+#endif
@@ -0,0 +1,453 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// allocation counting, only in builds with SWAG_COUNT_ALLOCS (swag_bench):
+// the executable's malloc is the one every library links against, and
+// glibc keeps its own reachable as __libc_malloc. the counters are spread
+// over cache lines so threads don't fight over one
+#if defined(__GLIBC__) && defined(SWAG_COUNT_ALLOCS)
+extern "C"
+{
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* p, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+    void* __libc_valloc(size_t size);
+    void* __libc_pvalloc(size_t size);
+}
+
+namespace
+{
+    struct alignas(64) alloc_counter
+    {
+        std::atomic<uint64_t> count{0};
+    };
+
+    alloc_counter alloc_counters[16];
+    std::atomic<unsigned> alloc_threads{0};
+
+    inline void count_allocation()
+    {
+        static thread_local unsigned shard = alloc_threads.fetch_add(1, std::memory_order_relaxed) % 16;
+        alloc_counters[shard].count.fetch_add(1, std::memory_order_relaxed);
+    }
+} // namespace
+
+extern "C"
+{
+    void* malloc(size_t size)
+    {
+        count_allocation();
+        return __libc_malloc(size);
+    }
+
+    void* calloc(size_t count, size_t size)
+    {
+        count_allocation();
+        return __libc_calloc(count, size);
+    }
+
+    void* realloc(void* p, size_t size)
+    {
+        count_allocation();
+        return __libc_realloc(p, size);
+    }
+
+    void* memalign(size_t alignment, size_t size)
+    {
+        count_allocation();
+        return __libc_memalign(alignment, size);
+    }
+
+    void* aligned_alloc(size_t alignment, size_t size)
+    {
+        count_allocation();
+        return __libc_memalign(alignment, size);
+    }
+
+    int posix_memalign(void** p, size_t alignment, size_t size)
+    {
+        if (alignment % sizeof(void*) || (alignment & (alignment - 1)))
+            return EINVAL;
+
+        count_allocation();
+        void* block = __libc_memalign(alignment, size);
+        if (block == NULL)
+            return ENOMEM;
+        *p = block;
+        return 0;
+    }
+
+    void* valloc(size_t size)
+    {
+        count_allocation();
+        return __libc_valloc(size);
+    }
+
+    void* pvalloc(size_t size)
+    {
+        count_allocation();
+        return __libc_pvalloc(size);
+    }
+}
+
+static const bool allocations_counted = true;
+#else
+static const bool allocations_counted = false;
+#endif
+
+namespace Swag
+{
+    bool stats_enabled = false;
+    unsigned stats_slowest = 10;
+
+    // latency buckets: four per power of two, so percentiles are good to
+    // about 25% at any scale
+    static const unsigned histogram_buckets = 252;
+
+    struct thread_stats
+    {
+        uint64_t count[STAGE_COUNT] = {};
+        uint64_t total[STAGE_COUNT] = {};
+        uint64_t max[STAGE_COUNT] = {};
+        uint32_t histogram[STAGE_COUNT][histogram_buckets] = {};
+
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        uint64_t files = 0;
+        uint64_t busy = 0;
+
+        // min-heap on time, at most stats_slowest long
+        std::vector<std::pair<uint64_t, std::string>> slowest;
+    };
+
+    // entries outlive their threads, so the report still sees the workers
+    // of a pool that is gone
+    static std::mutex registry_lock;
+    static std::vector<std::unique_ptr<thread_stats>> registry;
+
+    static thread_stats& local()
+    {
+        static thread_local thread_stats* mine = NULL;
+
+        if (!mine)
+        {
+            std::lock_guard<std::mutex> l(registry_lock);
+            registry.emplace_back(new thread_stats);
+            mine = registry.back().get();
+        }
+        return *mine;
+    }
+
+    static unsigned bucket_of(uint64_t ns)
+    {
+        if (ns < 4)
+            return ns;
+
+        unsigned msb = 63 - __builtin_clzll(ns);
+        return (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+    }
+
+    // largest value that still falls into bucket b
+    static uint64_t bucket_limit(unsigned b)
+    {
+        if (b < 4)
+            return b;
+
+        unsigned msb = b / 4 + 1;
+        return ((uint64_t)(5 + b % 4) << (msb - 2)) - 1;
+    }
+
+    const char* stage_name(stage s)
+    {
+        static const char* names[STAGE_COUNT] = {"walk",   "stat",   "hash",  "open",  "decode", "resize",
+                                                 "encode", "write",  "stream", "tiles", "wait"};
+
+        return names[s];
+    }
+
+    uint64_t stats_clock()
+    {
+        timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    void stats_add(stage s, uint64_t start)
+    {
+        if (!start)
+            return;
+
+        uint64_t ns = stats_clock() - start;
+        thread_stats& t = local();
+
+        t.count[s]++;
+        t.total[s] += ns;
+        t.max[s] = std::max(t.max[s], ns);
+        t.histogram[s][bucket_of(ns)]++;
+    }
+
+    void stats_bytes_read(uint64_t bytes)
+    {
+        if (stats_enabled)
+            local().bytes_read += bytes;
+    }
+
+    void stats_bytes_written(uint64_t bytes)
+    {
+        if (stats_enabled)
+            local().bytes_written += bytes;
+    }
+
+    void stats_file(const std::string& filename, uint64_t start)
+    {
+        if (!start)
+            return;
+
+        uint64_t ns = stats_clock() - start;
+        thread_stats& t = local();
+        auto later = std::greater<std::pair<uint64_t, std::string>>();
+
+        t.files++;
+        t.busy += ns;
+
+        if (t.slowest.size() < stats_slowest)
+        {
+            t.slowest.emplace_back(ns, filename);
+            std::push_heap(t.slowest.begin(), t.slowest.end(), later);
+        }
+        else if (stats_slowest && ns > t.slowest.front().first)
+        {
+            std::pop_heap(t.slowest.begin(), t.slowest.end(), later);
+            t.slowest.back() = std::make_pair(ns, filename);
+            std::push_heap(t.slowest.begin(), t.slowest.end(), later);
+        }
+    }
+
+    uint64_t stats_allocations()
+    {
+        uint64_t total = 0;
+
+#if defined(__GLIBC__) && defined(SWAG_COUNT_ALLOCS)
+        for (auto& c : alloc_counters)
+            total += c.count.load(std::memory_order_relaxed);
+#endif
+        return total;
+    }
+
+    // every thread folded together
+    struct stage_summary
+    {
+        uint64_t count = 0;
+        uint64_t total = 0;
+        uint64_t max = 0;
+        uint64_t histogram[histogram_buckets] = {};
+
+        uint64_t percentile(double q) const
+        {
+            uint64_t rank = (uint64_t)(q * count + 0.5), seen = 0;
+
+            for (unsigned b = 0; b < histogram_buckets; b++)
+                if ((seen += histogram[b]) >= std::max<uint64_t>(rank, 1))
+                    return std::min(bucket_limit(b), max);
+            return max;
+        }
+    };
+
+    struct summary
+    {
+        stage_summary stages[STAGE_COUNT];
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        uint64_t files = 0;
+        uint64_t allocations = 0;
+        uint64_t peak_rss = 0;
+        uint64_t minor_faults = 0;
+        uint64_t major_faults = 0;
+        std::vector<std::pair<uint64_t, uint64_t>> threads;
+        std::vector<std::pair<uint64_t, std::string>> slowest;
+    };
+
+    static summary summarize()
+    {
+        summary sum;
+        std::lock_guard<std::mutex> l(registry_lock);
+
+        for (auto& t : registry)
+        {
+            for (unsigned s = 0; s < STAGE_COUNT; s++)
+            {
+                stage_summary& st = sum.stages[s];
+
+                st.count += t->count[s];
+                st.total += t->total[s];
+                st.max = std::max(st.max, t->max[s]);
+                for (unsigned b = 0; b < histogram_buckets; b++)
+                    st.histogram[b] += t->histogram[s][b];
+            }
+
+            sum.bytes_read += t->bytes_read;
+            sum.bytes_written += t->bytes_written;
+            sum.files += t->files;
+            if (t->files)
+                sum.threads.emplace_back(t->files, t->busy);
+            sum.slowest.insert(sum.slowest.end(), t->slowest.begin(), t->slowest.end());
+        }
+
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+        {
+            sum.peak_rss = (uint64_t)usage.ru_maxrss * 1024;
+            sum.minor_faults = usage.ru_minflt;
+            sum.major_faults = usage.ru_majflt;
+        }
+        sum.allocations = stats_allocations();
+
+        std::sort(sum.slowest.begin(), sum.slowest.end(), std::greater<std::pair<uint64_t, std::string>>());
+        if (sum.slowest.size() > stats_slowest)
+            sum.slowest.resize(stats_slowest);
+
+        return sum;
+    }
+
+    static double ms(uint64_t ns)
+    {
+        return ns / 1e6;
+    }
+
+    void stats_report(std::ostream& out)
+    {
+        summary sum = summarize();
+        char line[160];
+
+        snprintf(line, sizeof(line), "%-8s %9s %11s %9s %9s %9s %9s %9s", "stage", "count", "total ms", "mean ms", "p50 ms",
+                 "p90 ms", "p99 ms", "max ms");
+        out << line << std::endl;
+
+        for (unsigned s = 0; s < STAGE_COUNT; s++)
+        {
+            const stage_summary& st = sum.stages[s];
+
+            if (!st.count)
+                continue;
+
+            snprintf(line, sizeof(line), "%-8s %9llu %11.1f %9.3f %9.3f %9.3f %9.3f %9.3f", stage_name((stage)s),
+                     (unsigned long long)st.count, ms(st.total), ms(st.total) / st.count, ms(st.percentile(0.5)),
+                     ms(st.percentile(0.9)), ms(st.percentile(0.99)), ms(st.max));
+            out << line << std::endl;
+        }
+
+        out << "read " << sum.bytes_read / 1e6 << " MB, wrote " << sum.bytes_written / 1e6 << " MB" << std::endl;
+        if (allocations_counted)
+        {
+            out << sum.allocations << " allocations";
+            if (sum.files)
+                out << " (" << sum.allocations / sum.files << " per file)";
+            out << ", ";
+        }
+        out << "peak RSS " << sum.peak_rss / 1e6 << " MB, " << sum.minor_faults << " minor / " << sum.major_faults
+            << " major page faults" << std::endl;
+
+        for (size_t i = 0; i < sum.threads.size(); i++)
+            out << "thread " << i << ": " << sum.threads[i].first << " files, " << ms(sum.threads[i].second) << " ms busy"
+                << std::endl;
+
+        if (!sum.slowest.empty())
+        {
+            out << "slowest files:" << std::endl;
+            for (auto& f : sum.slowest)
+            {
+                snprintf(line, sizeof(line), "%11.1f ms  ", ms(f.first));
+                out << line << f.second << std::endl;
+            }
+        }
+    }
+
+    static std::string json_string(const std::string& s)
+    {
+        std::string out = "\"";
+
+        for (unsigned char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out += '\\';
+                out += c;
+            }
+            else if (c < 0x20)
+            {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                out += esc;
+            }
+            else
+                out += c;
+        }
+        return out + "\"";
+    }
+
+    bool stats_json(const std::string& filename)
+    {
+        summary sum = summarize();
+        std::ofstream o(filename);
+
+        o << "{\n  \"stages\": [";
+        const char* sep = "\n";
+        for (unsigned s = 0; s < STAGE_COUNT; s++)
+        {
+            const stage_summary& st = sum.stages[s];
+
+            if (!st.count)
+                continue;
+
+            o << sep << "    {\"stage\": \"" << stage_name((stage)s) << "\", \"count\": " << st.count
+              << ", \"total_ms\": " << ms(st.total) << ", \"mean_ms\": " << ms(st.total) / st.count
+              << ", \"p50_ms\": " << ms(st.percentile(0.5)) << ", \"p90_ms\": " << ms(st.percentile(0.9))
+              << ", \"p99_ms\": " << ms(st.percentile(0.99)) << ", \"max_ms\": " << ms(st.max) << "}";
+            sep = ",\n";
+        }
+        o << "\n  ],\n";
+
+        o << "  \"bytes_read\": " << sum.bytes_read << ",\n";
+        o << "  \"bytes_written\": " << sum.bytes_written << ",\n";
+        if (allocations_counted)
+            o << "  \"allocations\": " << sum.allocations << ",\n";
+        o << "  \"peak_rss\": " << sum.peak_rss << ",\n";
+        o << "  \"minor_faults\": " << sum.minor_faults << ",\n";
+        o << "  \"major_faults\": " << sum.major_faults << ",\n";
+
+        o << "  \"threads\": [";
+        for (size_t i = 0; i < sum.threads.size(); i++)
+            o << (i ? ", " : "") << "{\"files\": " << sum.threads[i].first << ", \"busy_ms\": " << ms(sum.threads[i].second) << "}";
+        o << "],\n";
+
+        o << "  \"slowest\": [";
+        for (size_t i = 0; i < sum.slowest.size(); i++)
+            o << (i ? "," : "") << "\n    {\"file\": " << json_string(sum.slowest[i].second)
+              << ", \"ms\": " << ms(sum.slowest[i].first) << "}";
+        o << "\n  ]\n}\n";
+
+        o.close();
+        if (!o)
+        {
+            std::cout << "Could not write " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+} // namespace Swag
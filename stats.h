@@ -0,0 +1,74 @@
+#ifndef SWAG_STATS_H
+#define SWAG_STATS_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// per-stage timing behind --stats
+//
+// every thread records into its own counters, latency histograms and list
+// of slowest files, so nothing takes a lock once a thread has registered.
+// with stats off a timer costs one branch and no clock read.
+//
+// usage: 1) set stats_enabled (and stats_slowest) before any work starts
+//        2) a stage_timer around each stage, stats_bytes_read/written()
+//           for the payload, stats_file() once per finished input
+//        3) stats_report() and/or stats_json() once every worker is idle
+namespace Swag
+{
+    enum stage
+    {
+        STAGE_WALK,
+        STAGE_STAT,
+        STAGE_HASH,
+        STAGE_OPEN,
+        STAGE_DECODE,
+        STAGE_RESIZE,
+        STAGE_ENCODE,
+        STAGE_WRITE,
+        STAGE_STREAM,
+        STAGE_TILES,
+        STAGE_WAIT, // held back by --mem-limit
+        STAGE_COUNT
+    };
+
+    const char* stage_name(stage s);
+
+    extern bool stats_enabled;
+    extern unsigned stats_slowest;
+
+    // monotonic nanoseconds
+    uint64_t stats_clock();
+    inline uint64_t stats_now() { return stats_enabled ? stats_clock() : 0; }
+
+    // account the time since start (a stats_now() value) to stage s
+    void stats_add(stage s, uint64_t start);
+    void stats_bytes_read(uint64_t bytes);
+    void stats_bytes_written(uint64_t bytes);
+    // one input done, start is when its work began
+    void stats_file(const std::string& filename, uint64_t start);
+
+    class stage_timer
+    {
+    public:
+        explicit stage_timer(stage s) : s(s), start(stats_now()) {}
+        ~stage_timer() { stats_add(s, start); }
+
+    private:
+        stage s;
+        uint64_t start;
+    };
+
+    // malloc/calloc/realloc/memalign calls since the process started, from
+    // every thread and library. only counted in builds with SWAG_COUNT_ALLOCS
+    // (swag_bench), 0 everywhere else
+    uint64_t stats_allocations();
+
+    // stage table, bytes moved, allocations and memory, per-thread totals
+    // and the slowest files
+    void stats_report(std::ostream& out);
+    bool stats_json(const std::string& filename);
+} // namespace Swag
+
+#endif
@@ -0,0 +1,1625 @@
+#include "thumbnail.h"
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+#include <math.h>
+#include <memory.h>
+#include <png.h>
+
+#include "io.h"
+#include "stats.h"
+#include "tiles.h"
+
+int def_scaleheight = 200;
+Swag::resize_filter def_filter = Swag::FILTER_BILINEAR;
+bool def_stream = false;
+bool def_mmap = false;
+bool def_exif = false;
+Swag::decode_profile def_profile = Swag::PROFILE_BALANCED;
+Swag::crop_mode def_crop = Swag::CROP_NONE;
+unsigned def_aspect_width = 1;
+unsigned def_aspect_height = 1;
+Swag::memory_budget* def_budget = NULL;
+int def_quality = 50;
+bool def_optimize = false;
+bool def_progressive = false;
+unsigned def_subsampling = 420;
+std::vector<unsigned> def_bigheights;
+unsigned def_fanout = 2;
+
+namespace Swag
+{
+    bool parse_profile(const std::string& name, decode_profile& profile)
+    {
+        static const decode_profile profiles[] = {PROFILE_FAST, PROFILE_BALANCED, PROFILE_BEST};
+
+        for (decode_profile p : profiles)
+        {
+            if (name == profile_name(p))
+            {
+                profile = p;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char* profile_name(decode_profile profile)
+    {
+        switch (profile)
+        {
+        case PROFILE_FAST:
+            return "fast";
+        case PROFILE_BEST:
+            return "best";
+        default:
+            return "balanced";
+        }
+    }
+
+    bool parse_crop(const std::string& name, crop_mode& crop)
+    {
+        static const crop_mode crops[] = {CROP_NONE, CROP_CENTER, CROP_FOCUS};
+
+        for (crop_mode c : crops)
+        {
+            if (name == crop_name(c))
+            {
+                crop = c;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char* crop_name(crop_mode crop)
+    {
+        switch (crop)
+        {
+        case CROP_CENTER:
+            return "center";
+        case CROP_FOCUS:
+            return "focus";
+        default:
+            return "none";
+        }
+    }
+
+    // libjpeg objects are made once per workspace and recycled: jpeg_abort
+    // (which jpeg_finish_* ends with too) drops the per-image pool but keeps
+    // the object, its permanent pool and its source or destination manager.
+    // that manager is either stdio or memory for good, so there is a decoder
+    // for each, and an encoder is made again when the kind it needs changes
+    struct jpeg_decoder
+    {
+        jpeg_decompress_struct dinfo;
+        jpeg_error_mgr jerr_mgr;
+        bool created = false;
+
+        ~jpeg_decoder()
+        {
+            if (created)
+                jpeg_destroy_decompress(&dinfo);
+        }
+    };
+
+    struct jpeg_encoder
+    {
+        jpeg_compress_struct cinfo;
+        jpeg_error_mgr jerr_mgr;
+        bool created = false;
+        bool to_memory = false;
+        // optimized huffman tables replaced the standard ones, which
+        // jpeg_set_defaults() won't put back
+        bool optimized = false;
+
+        ~jpeg_encoder()
+        {
+            if (created)
+                jpeg_destroy_compress(&cinfo);
+        }
+    };
+
+    // a thumbnail encoded into memory (--mmap, img->encoded or the library)
+    struct encoded_thumbnail
+    {
+        output_buffer buffer;
+        unsigned long size = 0;
+    };
+
+    struct workspace
+    {
+        scratch_space scratch;
+        // stdio and memory sources; --exif reads previews from memory
+        // whatever the file itself comes through
+        jpeg_decoder decoders[2];
+        // one per output size, stream_thumbnail runs them all at once
+        std::vector<std::unique_ptr<jpeg_encoder>> encoders;
+        std::vector<encoded_thumbnail> thumbs;
+        // when set, failures end up here instead of on stdout
+        std::string* errors = NULL;
+
+        // options->budget of the last job: what the running job reserved
+        // there, and the scratch that stays charged to it between jobs
+        memory_budget* budget = NULL;
+        size_t reserved = 0;
+        size_t held = 0;
+        // the running job could stream a jpeg whose frame doesn't fit, and
+        // decided to
+        bool streamable = false;
+        bool stream_instead = false;
+
+        ~workspace()
+        {
+            if (budget)
+                budget->finish(0, -(ptrdiff_t)held);
+        }
+    };
+
+    // what the command line works in, one per worker thread
+    static thread_local workspace thread_workspace;
+
+    // the def_* settings and the thread's workspace for callers that didn't
+    // bring their own, for as long as the outermost public call lasts
+    struct command_line_defaults
+    {
+        image* img;
+        thumbnail_options options;
+        bool own_options = false, own_ws = false;
+
+        command_line_defaults(image* img) : img(img)
+        {
+            if (!img->options)
+            {
+                options = command_line_options();
+                img->options = &options;
+                own_options = true;
+            }
+            if (!img->ws)
+            {
+                img->ws = &thread_workspace;
+                own_ws = true;
+            }
+        }
+
+        ~command_line_defaults()
+        {
+            if (own_options)
+                img->options = NULL;
+            if (own_ws)
+                img->ws = NULL;
+        }
+    };
+
+    // one generate_thumbnail() or make_thumbnail() call against
+    // options->budget: what its decodes reserved goes back at the end, and
+    // so does scratch beyond what a worker may keep
+    struct budget_job
+    {
+        workspace* ws;
+        memory_budget* budget;
+
+        budget_job(image* img, bool streamable) : ws(img->ws), budget(img->options->budget)
+        {
+            if (budget && ws->budget && ws->budget != budget)
+            {
+                ws->budget->finish(0, -(ptrdiff_t)ws->held);
+                ws->held = 0;
+            }
+            if (budget)
+                ws->budget = budget;
+
+            ws->streamable = streamable;
+            ws->stream_instead = false;
+        }
+
+        ~budget_job()
+        {
+            if (!budget)
+                return;
+
+            size_t kept = ws->scratch.slots[SCRATCH_FRAME].capacity + ws->scratch.slots[SCRATCH_ROWS].capacity;
+            if (kept > budget->keep())
+            {
+                ws->scratch.release(SCRATCH_FRAME);
+                ws->scratch.release(SCRATCH_ROWS);
+                kept = 0;
+            }
+
+            budget->finish(ws->reserved, (ptrdiff_t)kept - (ptrdiff_t)ws->held);
+            ws->reserved = 0;
+            ws->held = kept;
+        }
+    };
+
+    // reserve what decoding img is about to add: frame and rows bytes of
+    // scratch, transient bytes of codec memory. false when that doesn't fit
+    // right now and the caller would rather stream than wait
+    static bool admit(image* img, size_t frame, size_t rows, size_t transient, bool may_stream)
+    {
+        workspace* ws = img->ws;
+        memory_budget* budget = img->options->budget;
+
+        if (!budget)
+            return true;
+
+        size_t growth = ws->scratch.growth(SCRATCH_FRAME, frame) + ws->scratch.growth(SCRATCH_ROWS, rows);
+        size_t need = growth + transient;
+
+        // streaming only saves the frame
+        if (may_stream && ws->streamable && growth)
+        {
+            if (!budget->try_reserve(need))
+            {
+                ws->stream_instead = true;
+                return false;
+            }
+        }
+        else
+            budget->reserve(need, ws->reserved);
+
+        ws->reserved += need;
+        return true;
+    }
+
+    static void report_failure(image* img, const std::string& name, const char* message)
+    {
+        if (img->ws->errors)
+            *img->ws->errors = message;
+        else
+            std::cout << "Failed " << name << ": " << message << std::endl;
+    }
+
+    static void report_jpeg_error(image* img, j_common_ptr cinfo, const std::string& name)
+    {
+        char buffer[JMSG_LENGTH_MAX];
+
+        (*cinfo->err->format_message)(cinfo, buffer);
+        report_failure(img, name, buffer);
+    }
+
+    thumbnail_options command_line_options()
+    {
+        thumbnail_options options;
+
+        options.height = def_scaleheight;
+        options.bigger.assign(def_bigheights.rbegin(), def_bigheights.rend());
+        options.filter = def_filter;
+        options.profile = def_profile;
+        options.exif = def_exif;
+        options.quality = def_quality;
+        options.optimize = def_optimize;
+        options.progressive = def_progressive;
+        options.subsampling = def_subsampling;
+        options.crop = def_crop;
+        options.aspect_width = def_aspect_width;
+        options.aspect_height = def_aspect_height;
+        options.stream = def_stream;
+        options.mmap = def_mmap;
+        options.budget = def_budget;
+        return options;
+    }
+
+    std::string sized_filename(const std::string& out_filename, unsigned height, const thumbnail_options& options)
+    {
+        if (height == options.height)
+            return out_filename;
+
+        size_t dot = out_filename.rfind('.');
+        return out_filename.substr(0, dot) + "_" + std::to_string(height) + out_filename.substr(dot);
+    }
+
+    std::string thumbnail_path(const std::string& key)
+    {
+        std::string path = "/thumbs/";
+
+        for (unsigned d = 0; d < def_fanout && key.size() >= 2 * (d + 1); d++)
+            path += key.substr(2 * d, 2) + "/";
+        return path + key + ".jpg";
+    }
+
+    // all files generated for one input, largest first; the last one is
+    // the thumbnail itself, the bigger ones carry their height in the name
+    std::vector<std::string> thumbnail_filenames(const std::string& out_filename, const thumbnail_options& options)
+    {
+        std::vector<std::string> names;
+
+        for (unsigned l = 0; l < options.levels(); l++)
+            names.push_back(sized_filename(out_filename, options.level_height(l), options));
+        return names;
+    }
+
+    static unsigned scaled_width(image* img, unsigned height)
+    {
+        double ratio = (double)img->crop_width / (double)img->crop_height;
+        return (int)((double)height * ratio + 0.5);
+    }
+
+    // the largest part of a width x height picture with the crop's shape,
+    // or all of it without a crop
+    static void fit_crop(const thumbnail_options& options, unsigned width, unsigned height, unsigned& crop_width,
+                         unsigned& crop_height)
+    {
+        uint64_t aw = options.aspect_width, ah = options.aspect_height;
+
+        crop_width = width;
+        crop_height = height;
+        if (options.crop == CROP_NONE)
+            return;
+
+        if (width * ah > height * aw)
+            crop_width = std::max<uint64_t>(1, (height * aw + ah / 2) / ah);
+        else
+            crop_height = std::max<uint64_t>(1, (width * ah + aw / 2) / aw);
+    }
+
+    // img->crop_* for a picture of img->width x img->height, as close to
+    // centered on the focus as the edges allow
+    static void choose_crop(image* img)
+    {
+        fit_crop(*img->options, img->width, img->height, img->crop_width, img->crop_height);
+
+        auto place = [](double focus, unsigned size, unsigned crop) {
+            double start = focus * size - crop / 2.0;
+            return (unsigned)std::min(std::max(start + 0.5, 0.0), (double)(size - crop));
+        };
+
+        img->crop_x = place(img->focus_x, img->width, img->crop_width);
+        img->crop_y = place(img->focus_y, img->height, img->crop_height);
+    }
+
+    // size of the largest output for img, and the DCT scaling and decoder
+    // settings of the profile: the cheapest scaling that still decodes at
+    // least that many pixels of the crop (twice as many for best)
+    static void select_scale(image* img, jpeg_decompress_struct* dinfo)
+    {
+        img->width = dinfo->image_width;
+        img->height = dinfo->image_height;
+        img->num_components = dinfo->num_components;
+        choose_crop(img);
+
+        img->scaleheight = img->options->level_height(0);
+        img->scalewidth = scaled_width(img, img->scaleheight);
+
+        if (img->options->profile != PROFILE_BALANCED)
+        {
+            uint64_t need = img->options->profile == PROFILE_BEST ? 16 : 8;
+            unsigned m = 1;
+
+            while (m < 8 && ((uint64_t)img->crop_width * m < need * img->scalewidth ||
+                             (uint64_t)img->crop_height * m < need * img->scaleheight))
+                m++;
+
+            dinfo->scale_num = m;
+            dinfo->scale_denom = 8;
+
+            if (img->options->profile == PROFILE_FAST)
+            {
+                dinfo->dct_method = JDCT_IFAST;
+                dinfo->do_fancy_upsampling = FALSE;
+                dinfo->do_block_smoothing = FALSE;
+            }
+            else
+                dinfo->dct_method = JDCT_FLOAT;
+            return;
+        }
+
+        if (img->crop_width >= 8 * img->scalewidth)
+            dinfo->scale_denom = 8;
+        else if (img->crop_width >= 4 * img->scalewidth)
+            dinfo->scale_denom = 4;
+        else if (img->crop_width >= 2 * img->scalewidth)
+            dinfo->scale_denom = 2;
+    }
+
+    // after jpeg_start_decompress: tells the decoder to leave out the MCU
+    // columns left and right of the crop and to skip the rows above it, and
+    // sets img->output_* to the crop at the decoded scale. returns where the
+    // crop starts in a decoded row, in pixels
+    static unsigned start_crop(image* img, jpeg_decompress_struct* dinfo)
+    {
+        img->output_width = dinfo->output_width;
+        img->output_height = dinfo->output_height;
+
+        if (img->crop_width == img->width && img->crop_height == img->height)
+            return 0;
+
+        auto scale = [](unsigned v, unsigned from, unsigned to) { return (unsigned)(((uint64_t)v * to + from / 2) / from); };
+
+        JDIMENSION x = std::min(scale(img->crop_x, img->width, dinfo->output_width), dinfo->output_width - 1);
+        JDIMENSION y = std::min(scale(img->crop_y, img->height, dinfo->output_height), dinfo->output_height - 1);
+        img->output_width = std::max(1u, std::min(scale(img->crop_width, img->width, dinfo->output_width), dinfo->output_width - x));
+        img->output_height = std::max(1u, std::min(scale(img->crop_height, img->height, dinfo->output_height), dinfo->output_height - y));
+
+        // widened to whole iMCU columns, so the crop sits a little to the right
+        JDIMENSION left = x, width = img->output_width;
+        if (width < dinfo->output_width)
+            jpeg_crop_scanline(dinfo, &left, &width);
+        if (y)
+            jpeg_skip_scanlines(dinfo, y);
+
+        return x - left;
+    }
+
+    // the whole-image coefficient arrays libjpeg keeps for progressive
+    // files however far it scales, none for baseline ones
+    static size_t jpeg_coefficient_bytes(jpeg_decompress_struct* dinfo)
+    {
+        size_t coefficients = 0;
+
+        if (jpeg_has_multiple_scans(dinfo))
+            for (int c = 0; c < dinfo->num_components; c++)
+                coefficients += (size_t)dinfo->comp_info[c].width_in_blocks * dinfo->comp_info[c].height_in_blocks * sizeof(JBLOCK);
+        return coefficients;
+    }
+
+    // after select_scale(): reserve the frame of the crop at the chosen
+    // scale, when with_frame, and the coefficient arrays
+    static bool admit_jpeg(image* img, jpeg_decompress_struct* dinfo, bool with_frame, bool may_stream)
+    {
+        if (!img->options->budget)
+            return true;
+
+        size_t frame = 0;
+
+        if (with_frame)
+        {
+            jpeg_calc_output_dimensions(dinfo);
+            frame = ((uint64_t)dinfo->output_width * img->crop_width / img->width + 1) *
+                    ((uint64_t)dinfo->output_height * img->crop_height / img->height + 1) * img->num_components;
+        }
+
+        return admit(img, frame, 0, jpeg_coefficient_bytes(dinfo), may_stream);
+    }
+
+    // rows below a crop are never decoded
+    static void finish_crop(jpeg_decompress_struct* dinfo)
+    {
+        if (dinfo->output_scanline < dinfo->output_height)
+            jpeg_abort_decompress(dinfo);
+        else
+            jpeg_finish_decompress(dinfo);
+    }
+
+    static void start_thumbnail_compress(jpeg_compress_struct* cinfo, image* img, unsigned width, unsigned height)
+    {
+        cinfo->image_width = width;
+        cinfo->image_height = height;
+        cinfo->input_components = img->num_components;
+        cinfo->in_color_space = img->colorspace;
+
+        const thumbnail_options& options = *img->options;
+
+        jpeg_set_defaults(cinfo);
+        jpeg_set_quality(cinfo, options.quality, FALSE);
+        cinfo->optimize_coding = options.optimize;
+
+        // defaults are 2x2 luma sampling, i.e. 4:2:0
+        if (img->num_components == 3)
+        {
+            cinfo->comp_info[0].h_samp_factor = options.subsampling == 444 ? 1 : 2;
+            cinfo->comp_info[0].v_samp_factor = options.subsampling == 420 ? 2 : 1;
+        }
+
+        if (options.progressive)
+            jpeg_simple_progression(cinfo);
+
+        // a recycled encoder remembers which tables it already wrote
+        jpeg_start_compress(cinfo, TRUE);
+    }
+
+    static jpeg_decompress_struct* recycled_decoder(workspace* ws, bool mapped)
+    {
+        jpeg_decoder& d = ws->decoders[mapped];
+
+        if (!d.created)
+        {
+            d.dinfo.err = jpeg_std_error(&d.jerr_mgr);
+            d.jerr_mgr.error_exit = [](j_common_ptr cinfo) { throw cinfo->err; };
+            jpeg_create_decompress(&d.dinfo);
+            d.created = true;
+        }
+
+        return &d.dinfo;
+    }
+
+    static jpeg_encoder* recycled_encoder(image* img, unsigned level, bool to_memory)
+    {
+        workspace* ws = img->ws;
+        // progressive mode always optimizes its tables
+        bool optimized = img->options->optimize || img->options->progressive;
+
+        while (ws->encoders.size() <= level)
+            ws->encoders.emplace_back(new jpeg_encoder);
+
+        jpeg_encoder* e = ws->encoders[level].get();
+
+        if (e->created && (e->to_memory != to_memory || (e->optimized && !optimized)))
+        {
+            jpeg_destroy_compress(&e->cinfo);
+            e->created = false;
+        }
+
+        if (!e->created)
+        {
+            e->cinfo.err = jpeg_std_error(&e->jerr_mgr);
+            e->jerr_mgr.error_exit = [](j_common_ptr cinfo) { throw cinfo->err; };
+            jpeg_create_compress(&e->cinfo);
+            e->created = true;
+            e->to_memory = to_memory;
+        }
+
+        e->optimized = optimized;
+        return e;
+    }
+
+    static void attach_source(jpeg_decompress_struct* dinfo, input_file& in)
+    {
+        if (in.data)
+            jpeg_mem_src(dinfo, in.data, in.size);
+        else
+            jpeg_stdio_src(dinfo, in.file);
+    }
+
+    // where an encoded thumbnail goes: straight to a stdio file, or into
+    // ws->thumbs[level] until close_thumbnail writes it out (and copies it
+    // to img->encoded). without an out_filename it stays in memory only.
+    // --mmap encodes into memory too and writes each file with one write()
+    struct thumbnail_output
+    {
+        std::string filename;
+        workspace* ws = NULL;
+        unsigned level = 0;
+        FILE* file = NULL;
+        unsigned char* buffer = NULL;
+        unsigned long size = 0;
+        std::vector<unsigned char>* copy = NULL;
+    };
+
+    static bool open_thumbnail(image* img, unsigned height, unsigned level, thumbnail_output& out)
+    {
+        out.filename = img->out_filename.empty() ? "" : sized_filename(img->out_filename, height, *img->options);
+        out.ws = img->ws;
+        out.level = level;
+
+        if (img->options->mmap || img->encoded || out.filename.empty())
+        {
+            if (img->encoded)
+            {
+                if (img->encoded->size() <= level)
+                    img->encoded->resize(level + 1);
+                out.copy = &(*img->encoded)[level];
+            }
+
+            if (img->ws->thumbs.size() <= level)
+                img->ws->thumbs.resize(level + 1);
+
+            out.buffer = img->ws->thumbs[level].buffer.data;
+            out.size = img->ws->thumbs[level].buffer.capacity;
+            return true;
+        }
+
+        out.file = fopen(out.filename.c_str(), "wb");
+        if (!out.file && errno == ENOENT && make_parent_dirs(out.filename))
+            out.file = fopen(out.filename.c_str(), "wb");
+
+        if (!out.file)
+        {
+            std::cout << "Could not open " << strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    static void attach_thumbnail(jpeg_compress_struct* cinfo, thumbnail_output& out)
+    {
+        if (out.file)
+            jpeg_stdio_dest(cinfo, out.file);
+        else
+            jpeg_mem_dest(cinfo, &out.buffer, &out.size);
+    }
+
+    // flush a finished thumbnail, or throw away a failed one
+    static bool close_thumbnail(thumbnail_output& out, bool ok)
+    {
+        stage_timer timer(STAGE_WRITE);
+
+        if (out.file)
+        {
+            if (ok)
+                stats_bytes_written(ftell(out.file));
+            fflush(out.file);
+            fclose(out.file);
+            out.file = NULL;
+            if (!ok)
+                remove(out.filename.c_str());
+            return ok;
+        }
+
+        // libjpeg swaps in a bigger block of its own when ours overflows;
+        // after a failure we can't tell, so let it go
+        if (!ok)
+            return false;
+
+        encoded_thumbnail& t = out.ws->thumbs[out.level];
+        t.buffer.adopt(out.buffer, out.size);
+        t.size = out.size;
+        if (out.copy)
+            out.copy->assign(out.buffer, out.buffer + out.size);
+        if (out.filename.empty())
+            return true;
+
+        stats_bytes_written(out.size);
+        return write_file(out.filename, out.buffer, out.size);
+    }
+
+    static unsigned get16(const unsigned char* p, bool little)
+    {
+        return little ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+    }
+
+    static uint32_t get32(const unsigned char* p, bool little)
+    {
+        return little ? get16(p, true) | (uint32_t)get16(p + 2, true) << 16 : (uint32_t)get16(p, false) << 16 | get16(p + 2, false);
+    }
+
+    // what the markers ahead of the first scan say
+    struct jpeg_markers
+    {
+        unsigned width = 0;
+        unsigned height = 0;
+        const unsigned char* exif = NULL; // TIFF header onwards
+        size_t exif_size = 0;
+    };
+
+    // false without a frame header in the first size bytes
+    static bool scan_markers(const unsigned char* p, size_t size, jpeg_markers& m)
+    {
+        size_t pos = 2;
+
+        if (size < 4 || p[0] != 0xFF || p[1] != 0xD8)
+            return false;
+
+        while (pos + 4 <= size && p[pos] == 0xFF)
+        {
+            unsigned char marker = p[pos + 1];
+
+            // fill bytes
+            if (marker == 0xFF)
+            {
+                pos++;
+                continue;
+            }
+
+            if (marker == 0xDA || marker == 0xD9)
+                break;
+
+            size_t length = get16(p + pos + 2, false);
+            if (length < 2 || length > size - pos - 2)
+                break;
+
+            const unsigned char* segment = p + pos + 4;
+            size_t segment_size = length - 2;
+
+            if (marker == 0xE1 && !m.exif && segment_size > 6 && memcmp(segment, "Exif\0\0", 6) == 0)
+            {
+                m.exif = segment + 6;
+                m.exif_size = segment_size - 6;
+            }
+            else if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC &&
+                     segment_size >= 5)
+            {
+                m.height = get16(segment + 1, false);
+                m.width = get16(segment + 3, false);
+            }
+
+            pos += 2 + length;
+        }
+
+        return m.width && m.height;
+    }
+
+    // byte order of the TIFF header an Exif block starts with
+    static bool tiff_header(const unsigned char* t, size_t size, bool& little)
+    {
+        if (size < 8 || !(t[0] == t[1] && (t[0] == 'I' || t[0] == 'M')))
+            return false;
+
+        little = t[0] == 'I';
+        return get16(t + 2, little) == 42;
+    }
+
+    // the entry for tag in the IFD at offset ifd, NULL if it has none
+    static const unsigned char* ifd_entry(const unsigned char* t, size_t size, size_t ifd, unsigned tag, bool little)
+    {
+        if (ifd > size - 2)
+            return NULL;
+
+        size_t entries = get16(t + ifd, little);
+        for (size_t i = 0; i < entries && ifd + 2 + 12 * (i + 1) <= size; i++)
+        {
+            const unsigned char* e = t + ifd + 2 + 12 * i;
+
+            if (get16(e, little) == tag)
+                return e;
+        }
+        return NULL;
+    }
+
+    // the first n values of a SHORT or LONG entry
+    static bool ifd_values(const unsigned char* t, size_t size, const unsigned char* e, bool little, unsigned n, uint32_t* values)
+    {
+        unsigned type = get16(e + 2, little);
+        size_t count = get32(e + 4, little);
+        size_t bytes = type == 3 ? 2 : type == 4 ? 4 : 0;
+        const unsigned char* v = e + 8;
+
+        if (!bytes || count < n)
+            return false;
+
+        // more than fits the entry lives elsewhere
+        if (bytes * count > 4)
+        {
+            size_t offset = get32(e + 8, little);
+            if (offset > size || bytes * n > size - offset)
+                return false;
+            v = t + offset;
+        }
+
+        for (unsigned i = 0; i < n; i++)
+            values[i] = bytes == 2 ? get16(v + 2 * i, little) : get32(v + 4 * i, little);
+        return true;
+    }
+
+    // the middle of the subject a camera recorded in the Exif IFD, as a
+    // fraction of the picture: SubjectArea, or SubjectLocation
+    static bool exif_subject(const jpeg_markers& picture, double& x, double& y)
+    {
+        const unsigned char* t = picture.exif;
+        size_t size = picture.exif_size;
+        const unsigned char* e;
+        uint32_t ifd, at[2], width = picture.width, height = picture.height;
+        bool little;
+
+        if (!t || !tiff_header(t, size, little))
+            return false;
+
+        if (!(e = ifd_entry(t, size, get32(t + 4, little), 0x8769, little)) || !ifd_values(t, size, e, little, 1, &ifd))
+            return false;
+
+        if (!((e = ifd_entry(t, size, ifd, 0x9214, little)) && ifd_values(t, size, e, little, 2, at)) &&
+            !((e = ifd_entry(t, size, ifd, 0xA214, little)) && ifd_values(t, size, e, little, 2, at)))
+            return false;
+
+        // coordinates are in PixelXDimension x PixelYDimension when given
+        if ((e = ifd_entry(t, size, ifd, 0xA002, little)))
+            ifd_values(t, size, e, little, 1, &width);
+        if ((e = ifd_entry(t, size, ifd, 0xA003, little)))
+            ifd_values(t, size, e, little, 1, &height);
+
+        if (!width || !height || at[0] >= width || at[1] >= height)
+            return false;
+
+        x = (at[0] + 0.5) / width;
+        y = (at[1] + 0.5) / height;
+        return true;
+    }
+
+    // the JPEG that IFD1 of an Exif block points at, if there is one
+    static bool exif_thumbnail(const unsigned char* t, size_t size, const unsigned char** data, size_t* length)
+    {
+        bool little;
+
+        if (!tiff_header(t, size, little))
+            return false;
+
+        // IFD0 only matters for where IFD1 starts
+        size_t ifd = get32(t + 4, little);
+        if (ifd > size - 2)
+            return false;
+
+        size_t link = ifd + 2 + 12 * (size_t)get16(t + ifd, little);
+        if (link > size - 4 || (ifd = get32(t + link, little)) == 0 || ifd > size - 2)
+            return false;
+
+        size_t entries = get16(t + ifd, little);
+        uint32_t offset = 0, bytes = 0;
+
+        for (size_t i = 0; i < entries; i++)
+        {
+            const unsigned char* e = t + ifd + 2 + 12 * i;
+
+            if (ifd + 2 + 12 * (i + 1) > size)
+                return false;
+
+            // LONG as the spec says, though SHORT turns up too
+            uint32_t value = get16(e + 2, little) == 3 ? get16(e + 8, little) : get32(e + 8, little);
+
+            if (get16(e, little) == 0x0201)
+                offset = value;
+            else if (get16(e, little) == 0x0202)
+                bytes = value;
+        }
+
+        if (!offset || !bytes || offset > size || bytes > size - offset)
+            return false;
+
+        *data = t + offset;
+        *length = bytes;
+        return true;
+    }
+
+    // the markers of the picture itself, read only when --exif or a focus
+    // crop needs them. stdio sources have their head read into scratch
+    // memory and are rewound
+    static bool read_picture_markers(image* img, input_file& in, jpeg_markers& picture)
+    {
+        const unsigned char* head = in.data;
+        size_t head_size = in.size;
+
+        if (!img->options->exif && img->options->crop != CROP_FOCUS)
+            return false;
+
+        if (!head)
+        {
+            // Exif has to fit one APP1 segment, this leaves room for a
+            // JFIF header or an ICC profile in front of it
+            unsigned char* buffer = img->ws->scratch.get(SCRATCH_HEAD, 256 * 1024);
+
+            head_size = fread(buffer, 1, 256 * 1024, in.file);
+            head = buffer;
+            fseek(in.file, 0, SEEK_SET);
+        }
+
+        if (!scan_markers(head, head_size, picture))
+            return false;
+
+        if (img->options->crop == CROP_FOCUS)
+            exif_subject(picture, img->focus_x, img->focus_y);
+        return true;
+    }
+
+    // --exif: the preview a camera stores next to the picture, as long as
+    // it has the picture's shape and its crop covers the largest output size
+    static bool exif_preview(image* img, const jpeg_markers& picture, const unsigned char** data, size_t* size)
+    {
+        jpeg_markers preview;
+
+        if (!img->options->exif || !picture.exif || !exif_thumbnail(picture.exif, picture.exif_size, data, size) ||
+            !scan_markers(*data, *size, preview))
+            return false;
+
+        unsigned shape_width, shape_height, crop_width, crop_height;
+        fit_crop(*img->options, picture.width, picture.height, shape_width, shape_height);
+        fit_crop(*img->options, preview.width, preview.height, crop_width, crop_height);
+
+        unsigned height = img->options->level_height(0);
+        unsigned width = (unsigned)((double)height * shape_width / shape_height + 0.5);
+        double aspect = (double)picture.width / picture.height;
+
+        // letterboxed 4:3 previews of 3:2 pictures are common
+        return crop_height >= height && crop_width >= width &&
+               fabs((double)preview.width / preview.height - aspect) <= 0.01 * aspect;
+    }
+
+    // decode the whole frame from the file, or from a preview inside it
+    static bool decode_jpeg(image* img, input_file& in, const unsigned char* preview, size_t preview_size)
+    {
+        jpeg_decompress_struct* dinfo = recycled_decoder(img->ws, preview || in.data);
+
+        try
+        {
+            stage_timer timer(STAGE_DECODE);
+
+            if (preview)
+                jpeg_mem_src(dinfo, preview, preview_size);
+            else
+                attach_source(dinfo, in);
+
+            jpeg_read_header(dinfo, FALSE);
+            select_scale(img, dinfo);
+
+            // the header says how much this takes, stream it when that
+            // doesn't fit under --mem-limit now
+            if (!admit_jpeg(img, dinfo, true, !preview))
+            {
+                jpeg_abort_decompress(dinfo);
+                img->data = NULL;
+                return false;
+            }
+
+            jpeg_start_decompress(dinfo);
+            unsigned left = start_crop(img, dinfo);
+            img->colorspace = dinfo->out_color_space;
+
+            size_t row_width = (size_t)img->output_width * img->num_components;
+            img->data = img->ws->scratch.get(SCRATCH_FRAME, row_width * img->output_height);
+
+            // straight into the frame, no bounce through a decoder row,
+            // unless the crop doesn't line up with the decoded columns
+            bool bounce = dinfo->output_width != img->output_width;
+            JSAMPROW row = bounce ? img->ws->scratch.get(SCRATCH_ROWS, (size_t)dinfo->output_width * img->num_components) : NULL;
+
+            for (unsigned y = 0; y < img->output_height; y++)
+            {
+                JSAMPROW out = img->data + y * row_width;
+
+                if (!bounce)
+                    jpeg_read_scanlines(dinfo, &out, 1);
+                else
+                {
+                    jpeg_read_scanlines(dinfo, &row, 1);
+                    memcpy(out, row + (size_t)left * img->num_components, row_width);
+                }
+            }
+
+            finish_crop(dinfo);
+        }
+        catch (jpeg_error_mgr*)
+        {
+            // a broken preview just means decoding the picture itself
+            if (!preview)
+                report_jpeg_error(img, (j_common_ptr)dinfo, img->in_filename);
+            jpeg_abort_decompress(dinfo);
+            img->data = NULL;
+            return false;
+        }
+
+        return true;
+    }
+
+    static bool load_exif_preview(image* img, input_file& in, const jpeg_markers& picture)
+    {
+        const unsigned char* preview;
+        size_t size;
+
+        return exif_preview(img, picture, &preview, &size) && decode_jpeg(img, in, preview, size);
+    }
+
+    static bool decode_jpeg_source(image* img, input_file& in)
+    {
+        jpeg_markers picture;
+
+        if (read_picture_markers(img, in, picture) && load_exif_preview(img, in, picture))
+            return true;
+
+        return decode_jpeg(img, in, NULL, 0);
+    }
+
+    bool load_image_jpeg(image* img)
+    {
+        command_line_defaults defaults(img);
+        input_file infile;
+
+        if (!infile.open(img->in_filename, img->options->mmap))
+            return false;
+
+        return decode_jpeg_source(img, infile);
+    }
+
+    // feeds libpng from a mapped file
+    struct png_mapped_source
+    {
+        const unsigned char* data;
+        size_t size;
+        size_t pos;
+    };
+
+    static void read_png_mapped(png_structp png, png_bytep out, png_size_t length)
+    {
+        png_mapped_source* src = (png_mapped_source*)png_get_io_ptr(png);
+
+        if (length > src->size - src->pos)
+            png_error(png, "Premature end of PNG file");
+
+        memcpy(out, src->data + src->pos, length);
+        src->pos += length;
+    }
+
+    // reads a png row by row. start() is told the row buffer it will take
+    // once the header has set img->width, height, num_components and
+    // colorspace, and returns how many rows it wants; each of them then goes
+    // to row() top to bottom, alpha blended over white
+    static bool read_png(image* img, input_file& infile, const std::function<unsigned(size_t buffer)>& start,
+                         const std::function<void(unsigned y, const unsigned char* row)>& row)
+    {
+        png_structp png;
+        png_infop info;
+        png_mapped_source mapped;
+
+        png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                     [](png_structp, png_const_charp msg) { throw std::runtime_error(msg); },
+                                     [](png_structp, png_const_charp) {});
+        info = png_create_info_struct(png);
+
+        try
+        {
+            if (infile.data)
+            {
+                mapped = png_mapped_source{infile.data, infile.size, 0};
+                png_set_read_fn(png, &mapped, read_png_mapped);
+            }
+            else
+                png_init_io(png, infile.file);
+
+            png_read_info(png, info);
+
+            int color_type = png_get_color_type(png, info);
+            int bit_depth = png_get_bit_depth(png, info);
+
+            if (color_type == PNG_COLOR_TYPE_PALETTE)
+                png_set_palette_to_rgb(png);
+            if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+                png_set_expand_gray_1_2_4_to_8(png);
+            if (png_get_valid(png, info, PNG_INFO_tRNS))
+                png_set_tRNS_to_alpha(png);
+            if (bit_depth == 16)
+                png_set_scale_16(png);
+
+            int passes = png_set_interlace_handling(png);
+            png_read_update_info(png, info);
+
+            unsigned channels = png_get_channels(png, info);
+            bool alpha = channels == 2 || channels == 4;
+
+            img->width = png_get_image_width(png, info);
+            img->height = png_get_image_height(png, info);
+            img->num_components = alpha ? channels - 1 : channels;
+            img->colorspace = img->num_components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+            size_t row_bytes = png_get_rowbytes(png, info);
+            unsigned end = std::min(img->height, start(passes > 1 ? row_bytes * img->height : row_bytes));
+            unsigned char* flat = alpha ? img->ws->scratch.get(SCRATCH_BLEND, (size_t)img->width * img->num_components) : NULL;
+
+            auto push = [&](unsigned y, const unsigned char* r) {
+                if (!alpha)
+                {
+                    row(y, r);
+                    return;
+                }
+
+                // blend over white, JPEG has nowhere to keep the alpha
+                unsigned char* f = flat;
+                for (unsigned x = 0; x < img->width; x++, r += channels)
+                {
+                    unsigned a = r[channels - 1];
+                    for (unsigned c = 0; c < img->num_components; c++)
+                        *f++ = (unsigned char)((r[c] * a + 255 * (255 - a) + 127) / 255);
+                }
+                row(y, flat);
+            };
+
+            if (passes > 1)
+            {
+                // Adam7 only completes a row in the last pass, so interlaced
+                // files are the one case that needs the whole frame
+                unsigned char* frame = img->ws->scratch.get(SCRATCH_ROWS, row_bytes * img->height);
+                std::vector<png_bytep> rows(img->height);
+
+                for (unsigned y = 0; y < img->height; y++)
+                    rows[y] = frame + y * row_bytes;
+
+                png_read_image(png, rows.data());
+
+                for (unsigned y = 0; y < end; y++)
+                    push(y, rows[y]);
+                png_read_end(png, NULL);
+            }
+            else
+            {
+                unsigned char* r = img->ws->scratch.get(SCRATCH_ROWS, row_bytes);
+
+                // nothing below the last wanted row is read
+                for (unsigned y = 0; y < end; y++)
+                {
+                    png_read_row(png, r, NULL);
+                    push(y, r);
+                }
+                if (end == img->height)
+                    png_read_end(png, NULL);
+            }
+        }
+        catch (std::exception& e)
+        {
+            report_failure(img, img->in_filename, e.what());
+            png_destroy_read_struct(&png, &info, NULL);
+            return false;
+        }
+
+        png_destroy_read_struct(&png, &info, NULL);
+
+        return true;
+    }
+
+    // PNG has no decode-time scaling, so rows are reduced on their way in:
+    // img->data ends up holding the largest output size, never the full
+    // frame. palette, low bit depth and 16 bit images are expanded or
+    // scaled to 8 bit by libpng, alpha is composited onto white by read_png
+    static bool decode_png(image* img, input_file& infile)
+    {
+        std::unique_ptr<row_resizer> resizer;
+        unsigned t_row_width = 0;
+        unsigned char* o = NULL;
+
+        // rows are reduced on their way in, so this includes the resize
+        stage_timer timer(STAGE_DECODE);
+
+        bool ok = read_png(
+            img, infile,
+            [&](size_t buffer) {
+                choose_crop(img);
+
+                img->scaleheight = img->options->level_height(0);
+                img->scalewidth = scaled_width(img, img->scaleheight);
+                img->output_width = img->scalewidth;
+                img->output_height = img->scaleheight;
+
+                t_row_width = img->scalewidth * img->num_components;
+                admit(img, (size_t)t_row_width * img->scaleheight, buffer, 0, false);
+
+                o = img->data = img->ws->scratch.get(SCRATCH_FRAME, (size_t)t_row_width * img->scaleheight);
+                resizer.reset(new row_resizer(img->options->filter, img->num_components, img->crop_width, img->crop_height,
+                                              img->scalewidth, img->scaleheight, [&](const unsigned char* row) {
+                                                  memcpy(o, row, t_row_width);
+                                                  o += t_row_width;
+                                              }));
+
+                // nothing below the crop is read
+                return img->crop_y + img->crop_height;
+            },
+            // rows and columns outside the crop are dropped here
+            [&](unsigned y, const unsigned char* row) {
+                if (y >= img->crop_y)
+                    resizer->push(row + (size_t)img->crop_x * img->num_components);
+            });
+
+        if (!ok)
+            img->data = NULL;
+        return ok;
+    }
+
+    bool load_image_png(image* img)
+    {
+        command_line_defaults defaults(img);
+        input_file infile;
+
+        if (!infile.open(img->in_filename, img->options->mmap))
+            return false;
+
+        return decode_png(img, infile);
+    }
+
+    static bool encode_thumbnail(image* img, const unsigned char* o, unsigned width, unsigned height, unsigned level)
+    {
+        JSAMPROW row_pointer[1];
+        thumbnail_output outfile;
+
+        if (!open_thumbnail(img, height, level, outfile))
+            return false;
+
+        jpeg_compress_struct* cinfo = &recycled_encoder(img, level, !outfile.file)->cinfo;
+        try
+        {
+            stage_timer timer(STAGE_ENCODE);
+
+            attach_thumbnail(cinfo, outfile);
+            start_thumbnail_compress(cinfo, img, width, height);
+
+            while (cinfo->next_scanline < cinfo->image_height)
+            {
+                row_pointer[0] = (JSAMPROW)&o[(size_t)cinfo->input_components * cinfo->image_width * cinfo->next_scanline];
+                jpeg_write_scanlines(cinfo, row_pointer, 1);
+            }
+
+            jpeg_finish_compress(cinfo);
+        }
+        catch (jpeg_error_mgr*)
+        {
+            report_jpeg_error(img, (j_common_ptr)cinfo, outfile.filename);
+            jpeg_abort_compress(cinfo);
+            close_thumbnail(outfile, false);
+            return false;
+        }
+
+        return close_thumbnail(outfile, true);
+    }
+
+    bool create_thumbnail(image* img)
+    {
+        command_line_defaults defaults(img);
+        const unsigned char* src = img->data;
+        unsigned src_width = img->output_width, src_height = img->output_height;
+        scratch_slot target = SCRATCH_RESIZE;
+        bool ok = true;
+
+        // the largest size comes from the decoded frame, every smaller one
+        // from the size before it, so the two resize slots take turns
+        for (unsigned l = 0; l < img->options->levels() && ok; l++)
+        {
+            unsigned height = img->options->level_height(l), width = scaled_width(img, height);
+            const unsigned char* o = src;
+
+            if (!(src_width == width && (src_height == height || src_height == height + 1)))
+            {
+                unsigned char* t = img->ws->scratch.get(target, (size_t)width * height * img->num_components);
+
+                uint64_t start = stats_now();
+                resize(img->options->filter, img->num_components, src_width, src_height, width, height, src, t);
+                stats_add(STAGE_RESIZE, start);
+
+                o = t;
+                target = target == SCRATCH_RESIZE ? SCRATCH_RESIZE_ALT : SCRATCH_RESIZE;
+            }
+
+            ok = encode_thumbnail(img, o, width, height, l);
+
+            src = o;
+            src_width = width;
+            src_height = height;
+        }
+
+        return ok;
+    }
+
+    // decode, resize and encode in a single pass: every scanline goes
+    // through a row_resizer straight into the encoder, so only a few source
+    // rows are alive at a time however large the image is. with several
+    // sizes the resizers are chained, each one feeding its encoder and the
+    // resizer of the next smaller size
+    bool stream_thumbnail(image* img)
+    {
+        struct level
+        {
+            jpeg_compress_struct* cinfo = NULL;
+            thumbnail_output out;
+            std::unique_ptr<row_resizer> resizer;
+        };
+
+        command_line_defaults defaults(img);
+        std::vector<level> levels(img->options->levels());
+        jpeg_decompress_struct* dinfo;
+        JSAMPARRAY samp;
+        input_file infile;
+        bool ok = true;
+
+        if (!infile.open(img->in_filename, img->options->mmap))
+            return false;
+
+        // a preview is small enough to take the whole frame path
+        jpeg_markers picture;
+        if (read_picture_markers(img, infile, picture) && load_exif_preview(img, infile, picture))
+            return create_thumbnail(img);
+
+        for (unsigned l = 0; l < levels.size() && ok; l++)
+            ok = open_thumbnail(img, img->options->level_height(l), l, levels[l].out);
+
+        if (!ok)
+        {
+            for (auto& lv : levels)
+                close_thumbnail(lv.out, false);
+            return false;
+        }
+
+        dinfo = recycled_decoder(img->ws, infile.data != NULL);
+        for (unsigned l = 0; l < levels.size(); l++)
+            levels[l].cinfo = &recycled_encoder(img, l, !levels[l].out.file)->cinfo;
+
+        try
+        {
+            // decode, resize and encode interleave row by row, one stage
+            stage_timer timer(STAGE_STREAM);
+
+            attach_source(dinfo, infile);
+            jpeg_read_header(dinfo, FALSE);
+            select_scale(img, dinfo);
+            admit_jpeg(img, dinfo, false, false);
+
+            jpeg_start_decompress(dinfo);
+            unsigned left = start_crop(img, dinfo);
+            img->colorspace = dinfo->out_color_space;
+
+            unsigned src_width = img->output_width, src_height = img->output_height;
+            for (unsigned l = 0; l < levels.size(); l++)
+            {
+                level* self = &levels[l];
+                level* next = l + 1 < levels.size() ? &levels[l + 1] : NULL;
+                unsigned height = img->options->level_height(l), width = scaled_width(img, height);
+
+                attach_thumbnail(self->cinfo, self->out);
+                start_thumbnail_compress(self->cinfo, img, width, height);
+
+                self->resizer.reset(new row_resizer(img->options->filter, img->num_components, src_width, src_height, width, height,
+                                                    [self, next](const unsigned char* row) {
+                                                        JSAMPROW row_pointer[1] = {(JSAMPROW)row};
+                                                        jpeg_write_scanlines(self->cinfo, row_pointer, 1);
+                                                        if (next)
+                                                            next->resizer->push(row);
+                                                    }));
+
+                src_width = width;
+                src_height = height;
+            }
+
+            samp = (*dinfo->mem->alloc_sarray)((j_common_ptr)dinfo, JPOOL_IMAGE, dinfo->output_width * img->num_components, 1);
+
+            for (unsigned y = 0; y < img->output_height; y++)
+            {
+                jpeg_read_scanlines(dinfo, samp, 1);
+                levels.front().resizer->push(*samp + left * img->num_components);
+            }
+
+            finish_crop(dinfo);
+            for (auto& lv : levels)
+                jpeg_finish_compress(lv.cinfo);
+        }
+        catch (jpeg_error_mgr* err)
+        {
+            if (err == dinfo->err)
+                report_jpeg_error(img, (j_common_ptr)dinfo, img->in_filename);
+
+            for (auto& lv : levels)
+                if (err == lv.cinfo->err)
+                    report_jpeg_error(img, (j_common_ptr)lv.cinfo, lv.out.filename);
+
+            // back to idle for the next file, whichever one failed
+            jpeg_abort_decompress(dinfo);
+            for (auto& lv : levels)
+                jpeg_abort_compress(lv.cinfo);
+
+            ok = false;
+        }
+
+        for (auto& lv : levels)
+            ok = close_thumbnail(lv.out, ok) && ok;
+
+        return ok;
+    }
+
+    // deep-zoom tiles are square, the size DZI and IIIF viewers default to
+    static const unsigned tile_size = 256;
+
+    // by the extension, as the walk picked the file
+    static bool png_filename(const std::string& filename)
+    {
+        size_t dot = filename.rfind('.');
+        std::string ext;
+
+        if (dot != std::string::npos && filename.find('/', dot) == std::string::npos)
+            ext = filename.substr(dot);
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+        return ext == ".png";
+    }
+
+    std::string tiles_filename(const std::string& out_filename)
+    {
+        return out_filename.substr(0, out_filename.rfind('.')) + ".dzi";
+    }
+
+    std::string tiles_directory(const std::string& filename)
+    {
+        return filename.substr(0, filename.rfind('.')) + "_files";
+    }
+
+    // one tile, encoded into memory and written with a single write()
+    static bool encode_tile(image* img, const std::string& filename, const unsigned char* pixels, size_t stride, unsigned width,
+                            unsigned height)
+    {
+        // the encoder and buffer after the thumbnail sizes' own
+        unsigned level = img->options->levels();
+        workspace* ws = img->ws;
+
+        if (ws->thumbs.size() <= level)
+            ws->thumbs.resize(level + 1);
+
+        encoded_thumbnail& t = ws->thumbs[level];
+        unsigned char* buffer = t.buffer.data;
+        unsigned long size = t.buffer.capacity;
+        jpeg_compress_struct* cinfo = &recycled_encoder(img, level, true)->cinfo;
+
+        try
+        {
+            jpeg_mem_dest(cinfo, &buffer, &size);
+            start_thumbnail_compress(cinfo, img, width, height);
+
+            while (cinfo->next_scanline < height)
+            {
+                JSAMPROW row = (JSAMPROW)(pixels + stride * cinfo->next_scanline);
+                jpeg_write_scanlines(cinfo, &row, 1);
+            }
+
+            jpeg_finish_compress(cinfo);
+        }
+        catch (jpeg_error_mgr*)
+        {
+            report_jpeg_error(img, (j_common_ptr)cinfo, filename);
+            jpeg_abort_compress(cinfo);
+            return false;
+        }
+
+        t.buffer.adopt(buffer, size);
+        t.size = size;
+        stats_bytes_written(size);
+        return write_file(filename, buffer, size);
+    }
+
+    // every row of a jpeg at full size. start() is called before anything
+    // is allocated, with img->width, height, num_components and colorspace
+    // set and told the bytes the decoder itself will take
+    static bool read_jpeg_rows(image* img, input_file& in, const std::function<void(size_t transient)>& start,
+                               const std::function<void(const unsigned char* row)>& row)
+    {
+        jpeg_decompress_struct* dinfo = recycled_decoder(img->ws, in.data != NULL);
+
+        try
+        {
+            attach_source(dinfo, in);
+            jpeg_read_header(dinfo, FALSE);
+
+            jpeg_calc_output_dimensions(dinfo);
+            img->width = dinfo->output_width;
+            img->height = dinfo->output_height;
+            img->num_components = dinfo->output_components;
+            img->colorspace = dinfo->out_color_space;
+            start(jpeg_coefficient_bytes(dinfo) + (size_t)dinfo->output_width * dinfo->output_components);
+
+            jpeg_start_decompress(dinfo);
+
+            JSAMPARRAY samp =
+                (*dinfo->mem->alloc_sarray)((j_common_ptr)dinfo, JPOOL_IMAGE, dinfo->output_width * dinfo->output_components, 1);
+
+            while (dinfo->output_scanline < dinfo->output_height)
+            {
+                jpeg_read_scanlines(dinfo, samp, 1);
+                row(*samp);
+            }
+
+            jpeg_finish_decompress(dinfo);
+        }
+        catch (jpeg_error_mgr*)
+        {
+            report_jpeg_error(img, (j_common_ptr)dinfo, img->in_filename);
+            jpeg_abort_decompress(dinfo);
+            return false;
+        }
+
+        return true;
+    }
+
+    bool generate_tiles(image* img)
+    {
+        command_line_defaults defaults(img);
+        budget_job job(img, false);
+        std::string dzi = tiles_filename(img->out_filename);
+        std::string dir = tiles_directory(img->out_filename) + "/";
+        std::unique_ptr<tile_pyramid> pyramid;
+        input_file infile;
+
+        if (!infile.open(img->in_filename, img->options->mmap))
+            return false;
+
+        // decode, reduce and encode interleave row by row, one stage
+        stage_timer timer(STAGE_TILES);
+
+        // an earlier version of the picture may have had more of them
+        remove_tree(dir);
+
+        // the pyramid and what the decoder needs are reserved together, a
+        // job that waited holding one part could block one holding another
+        auto start = [&](size_t rows, size_t transient) {
+            admit(img, 0, rows, transient + tile_pyramid::footprint(img->num_components, img->width, img->height, tile_size),
+                  false);
+            pyramid.reset(new tile_pyramid(img->num_components, img->width, img->height, tile_size,
+                                           [&](unsigned level, unsigned column, unsigned row, const unsigned char* pixels,
+                                               size_t stride, unsigned width, unsigned height) {
+                                               std::string name = dir + std::to_string(level) + "/" + std::to_string(column) +
+                                                                  "_" + std::to_string(row) + ".jpg";
+                                               return encode_tile(img, name, pixels, stride, width, height);
+                                           }));
+        };
+        auto row = [&](const unsigned char* r) {
+            // after a failed tile there is nothing left to do with the rest
+            if (pyramid->ok())
+                pyramid->push(r);
+        };
+
+        bool ok;
+        if (png_filename(img->in_filename))
+            ok = read_png(
+                img, infile,
+                [&](size_t buffer) {
+                    start(buffer, 0);
+                    return img->height;
+                },
+                [&](unsigned, const unsigned char* r) { row(r); });
+        else
+            ok = read_jpeg_rows(img, infile, [&](size_t transient) { start(0, transient); }, row);
+
+        if (!ok || !pyramid->finished() || !pyramid->ok())
+        {
+            remove_tree(dir);
+            return false;
+        }
+
+        // last, so it only exists once every tile does
+        std::string descriptor = dzi_descriptor(img->width, img->height, tile_size);
+        return write_file(dzi, (const unsigned char*)descriptor.data(), descriptor.size());
+    }
+
+    // decode, resize and encode a single image; only touches its own
+    // image struct, so any number of these can run at once
+    bool generate_thumbnail(image* img)
+    {
+        command_line_defaults defaults(img);
+        budget_job job(img, !img->options->stream);
+
+        // png rows are always reduced as they come in, --stream is only
+        // needed for jpeg
+        if (png_filename(img->in_filename))
+        {
+            if (!load_image_png(img))
+                return false;
+
+            return create_thumbnail(img);
+        }
+
+        if (img->options->stream)
+            return stream_thumbnail(img);
+
+        if (!load_image_jpeg(img))
+        {
+            if (!img->ws->stream_instead)
+                return false;
+
+            // its frame didn't fit under --mem-limit
+            img->ws->streamable = false;
+            return stream_thumbnail(img);
+        }
+
+        return create_thumbnail(img);
+    }
+
+    thumbnail_scratch::thumbnail_scratch() : ws(new workspace)
+    {
+    }
+
+    thumbnail_scratch::~thumbnail_scratch() = default;
+
+    bool make_thumbnail(const unsigned char* data, size_t size, const thumbnail_options& options, thumbnail_scratch& scratch,
+                        thumbnail_result& result)
+    {
+        image img;
+        input_file in;
+        bool ok;
+
+        img.options = &options;
+        img.ws = scratch.ws.get();
+        img.ws->errors = &result.error;
+        result.error.clear();
+        in.borrow(data, size);
+
+        budget_job job(&img, false);
+
+        // png by its signature, libjpeg complains about anything else
+        if (size >= 8 && png_sig_cmp(data, 0, 8) == 0)
+            ok = decode_png(&img, in);
+        else
+            ok = decode_jpeg_source(&img, in);
+        ok = ok && create_thumbnail(&img);
+
+        img.ws->errors = NULL;
+        result.outputs.resize(ok ? options.levels() : 0);
+        for (unsigned l = 0; l < result.outputs.size(); l++)
+        {
+            unsigned height = options.level_height(l);
+            result.outputs[l] = thumbnail_result::output{img.ws->thumbs[l].buffer.data, img.ws->thumbs[l].size,
+                                                         scaled_width(&img, height), height};
+        }
+
+        return ok;
+    }
+} // namespace Swag
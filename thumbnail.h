@@ -0,0 +1,237 @@
+#ifndef SWAG_THUMBNAIL_H
+#define SWAG_THUMBNAIL_H
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "resize.h"
+
+namespace Swag
+{
+    // how hard the jpeg decoder works. balanced picks 1/2, 1/4 or 1/8 DCT
+    // scaling with the default decoder settings; fast takes the M/8 scale
+    // closest to the target with the fast integer DCT, plain upsampling and
+    // no block smoothing; best decodes at twice the target or more with the
+    // float DCT, leaving the rest to the resampler
+    enum decode_profile
+    {
+        PROFILE_FAST,
+        PROFILE_BALANCED,
+        PROFILE_BEST
+    };
+
+    // "fast", "balanced" or "best"
+    bool parse_profile(const std::string& name, decode_profile& profile);
+    const char* profile_name(decode_profile profile);
+
+    // cutting thumbnails to a fixed shape. center keeps the middle of the
+    // picture, focus keeps the subject a JPEG's Exif SubjectArea or
+    // SubjectLocation points at and falls back to the middle. JPEGs only
+    // decode the MCU rows and columns that cover the crop
+    enum crop_mode
+    {
+        CROP_NONE,
+        CROP_CENTER,
+        CROP_FOCUS
+    };
+
+    // "none", "center" or "focus"
+    bool parse_crop(const std::string& name, crop_mode& crop);
+    const char* crop_name(crop_mode crop);
+
+    class memory_budget;
+
+    // what the thumbnails of a picture look like and how hard the codecs
+    // work for them. the command line gets one from the def_* settings
+    // below, library callers fill in their own
+    struct thumbnail_options
+    {
+        unsigned height = 200;          // the thumbnail
+        std::vector<unsigned> bigger;   // extra sizes, largest first
+        resize_filter filter = FILTER_BILINEAR;
+        decode_profile profile = PROFILE_BALANCED;
+        bool exif = false;
+        int quality = 50;
+        bool optimize = false;
+        bool progressive = false;
+        unsigned subsampling = 420;
+        crop_mode crop = CROP_NONE;
+        unsigned aspect_width = 1;      // shape of a cropped thumbnail
+        unsigned aspect_height = 1;
+        // how the file calls read and write, see --stream and --mmap;
+        // make_thumbnail() works in memory and ignores both
+        bool stream = false;
+        bool mmap = false;
+        // decodes wait for room here (see io.h); what a call reserved is
+        // returned when its generate_thumbnail(), generate_tiles() or
+        // make_thumbnail() ends
+        memory_budget* budget = NULL;
+
+        unsigned levels() const { return bigger.size() + 1; }
+        // height of output l, largest first
+        unsigned level_height(unsigned l) const { return l < bigger.size() ? bigger[l] : height; }
+    };
+
+    // scratch memory and recycled codec objects, see thumbnail_scratch
+    struct workspace;
+} // namespace Swag
+
+// thumbnail settings, set once from the command line before any work starts
+extern int def_scaleheight;
+extern Swag::resize_filter def_filter;
+extern bool def_stream;
+extern bool def_mmap;
+extern bool def_exif;
+extern Swag::decode_profile def_profile;
+extern Swag::crop_mode def_crop;
+extern unsigned def_aspect_width;
+extern unsigned def_aspect_height;
+// --mem-limit, NULL without one
+extern Swag::memory_budget* def_budget;
+
+// encoder settings; subsampling is 444, 422 or 420 and only applies to color
+extern int def_quality;
+extern bool def_optimize;
+extern bool def_progressive;
+extern unsigned def_subsampling;
+extern std::vector<unsigned> def_bigheights;
+
+// directory levels under thumbs/, each named after the next two characters
+// of the key: 2 gives thumbs/ab/cd/abcd....jpg, 0 the old flat directory
+extern unsigned def_fanout;
+
+struct image
+{
+    unsigned num_components = 0;
+    unsigned width = 0;
+    unsigned height = 0;
+    unsigned output_width = 0;
+    unsigned output_height = 0;
+    J_COLOR_SPACE colorspace = JCS_UNKNOWN;
+
+    std::string in_filename;
+    std::string out_filename;
+
+    // the part of the picture the thumbnails show, in picture pixels: all
+    // of it unless options->crop cuts it to a fixed shape
+    unsigned crop_x = 0;
+    unsigned crop_y = 0;
+    unsigned crop_width = 0;
+    unsigned crop_height = 0;
+
+    // where a focus crop centers, as a fraction of the picture
+    double focus_x = 0.5;
+    double focus_y = 0.5;
+
+    unsigned scalewidth = 0;
+    unsigned scaleheight = 0;
+    unsigned char* data = NULL;
+
+    // settings and memory to work with; left NULL, public calls use the
+    // def_* settings and the calling thread's own workspace
+    const Swag::thumbnail_options* options = NULL;
+    Swag::workspace* ws = NULL;
+
+    // when set, outputs are encoded into memory and each one is also left
+    // here after it is written, in thumbnail_filenames() order
+    std::vector<std::vector<unsigned char>>* encoded = NULL;
+};
+
+namespace Swag
+{
+    // where the thumbnail named key goes, relative to basepath, following
+    // def_fanout
+    std::string thumbnail_path(const std::string& key);
+    // out_filename with the height appended, unless it is options.height
+    // itself
+    std::string sized_filename(const std::string& out_filename, unsigned height, const thumbnail_options& options);
+    // all files generated for one input with options, largest first
+    std::vector<std::string> thumbnail_filenames(const std::string& out_filename, const thumbnail_options& options);
+
+    // decode the whole frame into img->data, DCT scaled as far as the
+    // largest output size allows. the frame lives in the scratch memory of
+    // img->ws (the calling thread's when that is NULL, see io.h) and stays
+    // valid until the next image is loaded there
+    bool load_image_jpeg(image* img);
+    // same for png; rows are reduced to the largest output size as they
+    // are read, except for interlaced files
+    bool load_image_png(image* img);
+
+    // resize img->data to every output size and encode them; the frame is
+    // left as it was, so it can be encoded again
+    bool create_thumbnail(image* img);
+    // decode, resize and encode row by row, see --stream
+    bool stream_thumbnail(image* img);
+
+    // whichever of the above fits the file and the settings
+    bool generate_thumbnail(image* img);
+
+    // deep-zoom pyramid of img->in_filename, see --tiles: decoded at full
+    // size row by row into a tile_pyramid (tiles.h), its 256 px tiles
+    // written to tiles_directory()/<level>/<column>_<row>.jpg and the
+    // descriptor to tiles_filename(), last
+    bool generate_tiles(image* img);
+    // out_filename with a .dzi extension
+    std::string tiles_filename(const std::string& out_filename);
+    // where the tiles of out_filename (or of its .dzi) go: <name>_files
+    std::string tiles_directory(const std::string& filename);
+
+    // the def_* settings as options
+    thumbnail_options command_line_options();
+
+    // library interface (libswag.a / libswag.so): thumbnails of a JPEG or
+    // PNG in memory, encoded into memory. it reads no files and no def_*
+    // settings; everything a call needs comes from its arguments, so calls
+    // on different scratches can run on any threads at once.
+    //
+    // usage: 1) thumbnail_options options; options.height = 300;
+    //        2) thumbnail_scratch scratch; one per thread, kept for good
+    //        3) make_thumbnail(data, size, options, scratch, result) for
+    //           every picture, reusing result as well
+
+    struct thumbnail_result
+    {
+        struct output
+        {
+            const unsigned char* data; // JPEG, inside the scratch until its next call
+            size_t size;
+            unsigned width;
+            unsigned height;
+        };
+
+        // one per size, largest first; the last one is options.height
+        std::vector<output> outputs;
+        // why it failed
+        std::string error;
+    };
+
+    // decoded frames, resize targets, libjpeg objects and encoded outputs
+    // of one caller. buffers grow to the largest picture seen and are kept,
+    // so a warm scratch only leaves libjpeg's and libpng's own per-image
+    // pools to allocate
+    class thumbnail_scratch
+    {
+    public:
+        thumbnail_scratch();
+        ~thumbnail_scratch();
+
+        thumbnail_scratch(const thumbnail_scratch&) = delete;
+        thumbnail_scratch& operator=(const thumbnail_scratch&) = delete;
+
+    private:
+        friend bool make_thumbnail(const unsigned char*, size_t, const thumbnail_options&, thumbnail_scratch&,
+                                   thumbnail_result&);
+        std::unique_ptr<workspace> ws;
+    };
+
+    // false, with result.error set, when data can't be decoded
+    bool make_thumbnail(const unsigned char* data, size_t size, const thumbnail_options& options, thumbnail_scratch& scratch,
+                        thumbnail_result& result);
+} // namespace Swag
+
+#endif
@@ -0,0 +1,128 @@
+#include "tiles.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace Swag
+{
+    unsigned tile_pyramid::level_count(unsigned width, unsigned height)
+    {
+        unsigned size = std::max(width, height), count = 1;
+
+        while (size > 1)
+        {
+            size = (size + 1) / 2;
+            count++;
+        }
+        return count;
+    }
+
+    size_t tile_pyramid::footprint(unsigned num_components, unsigned width, unsigned height, unsigned tile_size)
+    {
+        size_t bytes = 0;
+
+        for (unsigned l = level_count(width, height); l > 0; l--)
+        {
+            bytes += (size_t)width * num_components * (std::min(height, tile_size) + 2);
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+        return bytes;
+    }
+
+    tile_pyramid::tile_pyramid(unsigned num_components, unsigned width, unsigned height, unsigned tile_size, tile_sink emit)
+        : num_components(num_components), tile_size(tile_size), emit(emit)
+    {
+        unsigned count = level_count(width, height);
+
+        levels.resize(count);
+        for (unsigned l = 0; l < count; l++)
+        {
+            level& lv = levels[l];
+            size_t row_width = (size_t)width * num_components;
+
+            lv.index = count - 1 - l;
+            lv.width = width;
+            lv.height = height;
+            lv.band.resize(row_width * std::min(height, tile_size));
+
+            if (l + 1 < count)
+            {
+                lv.even.resize(row_width);
+                lv.half.resize((size_t)(width + 1) / 2 * num_components);
+            }
+
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+        }
+    }
+
+    void tile_pyramid::push(const unsigned char* row)
+    {
+        push(0, row);
+    }
+
+    void tile_pyramid::push(size_t l, const unsigned char* row)
+    {
+        level& lv = levels[l];
+        size_t row_width = (size_t)lv.width * num_components;
+        unsigned y = lv.pushed++;
+
+        memcpy(&lv.band[(y % tile_size) * row_width], row, row_width);
+
+        // pairs of rows make one row of the level below; a last odd row
+        // pairs with itself
+        if (l + 1 < levels.size())
+        {
+            if (y % 2)
+            {
+                reduce(lv, lv.even.data(), row);
+                push(l + 1, lv.half.data());
+            }
+            else if (y + 1 == lv.height)
+            {
+                reduce(lv, row, row);
+                push(l + 1, lv.half.data());
+            }
+            else
+                memcpy(lv.even.data(), row, row_width);
+        }
+
+        if ((y + 1) % tile_size == 0 || y + 1 == lv.height)
+            emit_band(lv, y % tile_size + 1);
+    }
+
+    // 2x2 box into lv.half, the last column of an odd width pairing with
+    // itself
+    void tile_pyramid::reduce(level& lv, const unsigned char* a, const unsigned char* b)
+    {
+        unsigned nc = num_components, half_width = (lv.width + 1) / 2;
+        unsigned char* o = lv.half.data();
+
+        for (unsigned x = 0; x < half_width; x++)
+        {
+            size_t left = (size_t)2 * x * nc, right = (size_t)std::min(2 * x + 1, lv.width - 1) * nc;
+
+            for (unsigned c = 0; c < nc; c++)
+                *o++ = (a[left + c] + a[right + c] + b[left + c] + b[right + c] + 2) >> 2;
+        }
+    }
+
+    void tile_pyramid::emit_band(level& lv, unsigned rows)
+    {
+        size_t stride = (size_t)lv.width * num_components;
+        unsigned band_row = (lv.pushed - 1) / tile_size;
+
+        for (unsigned x = 0; x < lv.width && good; x += tile_size)
+            good = emit(lv.index, x / tile_size, band_row, &lv.band[(size_t)x * num_components], stride,
+                        std::min(tile_size, lv.width - x), rows);
+    }
+
+    std::string dzi_descriptor(unsigned width, unsigned height, unsigned tile_size)
+    {
+        return "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+               "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"jpg\" Overlap=\"0\" TileSize=\"" +
+               std::to_string(tile_size) + "\">\n  <Size Width=\"" + std::to_string(width) + "\" Height=\"" +
+               std::to_string(height) + "\"/>\n</Image>\n";
+    }
+} // namespace Swag
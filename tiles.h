@@ -0,0 +1,73 @@
+#ifndef SWAG_TILES_H
+#define SWAG_TILES_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace Swag
+{
+    // deep-zoom pyramid (DZI layout) built from rows pushed top to bottom.
+    // the top level is the picture itself, every level below is half the
+    // one above (2x2 box, odd edges rounded up) down to a single pixel.
+    // each level keeps one band of tile_size rows: a finished band is cut
+    // into tiles and handed to emit, and every pair of rows is reduced into
+    // the level below as it arrives, so nothing near the whole picture is
+    // ever held.
+    //
+    // usage: 1) tile_pyramid pyramid(components, width, height, 256, emit)
+    //        2) pyramid.push(row) for every row, top to bottom
+    //        3) pyramid.ok() once finished(): false when emit failed, which
+    //           stops the tiles after it
+    class tile_pyramid
+    {
+    public:
+        // level 0 is 1x1, column and row count tiles from the top left.
+        // pixels start at the tile's top left corner, stride bytes apart
+        typedef std::function<bool(unsigned level, unsigned column, unsigned row, const unsigned char* pixels, size_t stride,
+                                   unsigned width, unsigned height)>
+            tile_sink;
+
+        tile_pyramid(unsigned num_components, unsigned width, unsigned height, unsigned tile_size, tile_sink emit);
+
+        void push(const unsigned char* row);
+        bool finished() const { return levels.front().pushed == levels.front().height; }
+        bool ok() const { return good; }
+
+        // levels of a width x height pyramid, the top one is level_count() - 1
+        static unsigned level_count(unsigned width, unsigned height);
+        // bytes a pyramid of that size holds while it is being built
+        static size_t footprint(unsigned num_components, unsigned width, unsigned height, unsigned tile_size);
+
+    private:
+        struct level
+        {
+            unsigned index;
+            unsigned width;
+            unsigned height;
+            unsigned pushed = 0;
+            std::vector<unsigned char> band; // tile_size rows
+            std::vector<unsigned char> even; // row waiting for its pair
+            std::vector<unsigned char> half; // the pair reduced, for the level below
+        };
+
+        void push(size_t l, const unsigned char* row);
+        void reduce(level& lv, const unsigned char* a, const unsigned char* b);
+        void emit_band(level& lv, unsigned rows);
+
+        unsigned num_components;
+        unsigned tile_size;
+        tile_sink emit;
+        bool good = true;
+
+        // top level first
+        std::vector<level> levels;
+    };
+
+    // the .dzi descriptor of a width x height picture with jpeg tiles and
+    // no overlap
+    std::string dzi_descriptor(unsigned width, unsigned height, unsigned tile_size);
+} // namespace Swag
+
+#endif
@@ -0,0 +1,209 @@
+#include "watch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include <dirent.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint32_t watch_mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR;
+
+Watcher::Watcher(const std::string& root, const std::vector<std::string>& extensions)
+    : root(root), extensions(extensions), fd(-1)
+{
+}
+
+Watcher::~Watcher()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+bool Watcher::wanted(const char* name) const
+{
+    size_t length = strlen(name);
+
+    for (auto& ext : extensions)
+        if (length > ext.size() && strcasecmp(name + length - ext.size(), ext.c_str()) == 0)
+            return true;
+    return false;
+}
+
+void Watcher::watch_tree(const std::string& dir)
+{
+    std::string path = dir.empty() ? root : root + "/" + dir;
+    int wd = inotify_add_watch(fd, path.c_str(), watch_mask);
+
+    if (wd < 0)
+    {
+        std::cout << "Could not watch " << path << ": " << strerror(errno) << std::endl;
+        if (errno == ENOSPC)
+            std::cout << "Raise fs.inotify.max_user_watches to watch this many folders" << std::endl;
+        return;
+    }
+    dirs[wd] = dir;
+
+    DIR* d = opendir(path.c_str());
+    if (!d)
+        return;
+
+    while (struct dirent* e = readdir(d))
+    {
+        const char* name = e->d_name;
+        unsigned char type = e->d_type;
+
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            continue;
+
+        if (type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (lstat((path + "/" + name).c_str(), &st) == 0)
+                type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+
+        if (type == DT_DIR && strcmp(name, "thumbs") != 0)
+            watch_tree(dir.empty() ? name : dir + "/" + name);
+    }
+    closedir(d);
+}
+
+// a directory moved out of the tree keeps its watches, drop them
+void Watcher::unwatch_tree(const std::string& dir)
+{
+    for (auto it = dirs.begin(); it != dirs.end();)
+    {
+        const std::string& d = it->second;
+
+        if (d.compare(0, dir.size(), dir) == 0 && (d.size() == dir.size() || d[dir.size()] == '/'))
+        {
+            inotify_rm_watch(fd, it->first);
+            it = dirs.erase(it);
+        }
+        else
+            ++it;
+    }
+}
+
+bool Watcher::start()
+{
+    if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+    {
+        std::cout << "Could not start watching: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    watch_tree("");
+    return !dirs.empty();
+}
+
+void Watcher::read_events(std::map<std::string, change>& changes)
+{
+    alignas(inotify_event) char buffer[65536];
+    ssize_t got;
+
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t at = 0; at < got;)
+        {
+            inotify_event* e = (inotify_event*)(buffer + at);
+            at += sizeof(inotify_event) + e->len;
+
+            if (e->mask & IN_Q_OVERFLOW)
+            {
+                // events were lost, look at everything again
+                changes.clear();
+                changes[""] = change{"", true, false};
+                watch_tree("");
+                continue;
+            }
+
+            auto dir = dirs.find(e->wd);
+            if (dir == dirs.end())
+                continue;
+
+            if (e->mask & IN_IGNORED)
+            {
+                dirs.erase(dir);
+                continue;
+            }
+
+            if (!e->len)
+                continue;
+
+            std::string path = dir->second.empty() ? e->name : dir->second + "/" + e->name;
+
+            if (e->mask & IN_ISDIR)
+            {
+                if (strcmp(e->name, "thumbs") == 0)
+                    continue;
+
+                if (e->mask & (IN_CREATE | IN_MOVED_TO))
+                {
+                    watch_tree(path);
+                    changes[path] = change{path, true, false};
+                }
+                else if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+                {
+                    if (e->mask & IN_MOVED_FROM)
+                        unwatch_tree(path);
+                    changes[path] = change{path, true, true};
+                }
+            }
+            else if (wanted(e->name))
+            {
+                if (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                    changes[path] = change{path, false, false};
+                else if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+                    changes[path] = change{path, false, true};
+            }
+        }
+    }
+}
+
+bool Watcher::wait(std::map<std::string, change>& changes, unsigned quiet_ms, unsigned max_ms)
+{
+    typedef std::chrono::steady_clock clock;
+    pollfd p = {fd, POLLIN, 0};
+    clock::time_point first;
+    int timeout = -1;
+
+    changes.clear();
+    for (;;)
+    {
+        int n = poll(&p, 1, timeout);
+
+        if (n < 0 && errno != EINTR)
+        {
+            std::cout << "Could not wait for changes: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        if (n > 0)
+            read_events(changes);
+
+        if (changes.empty())
+        {
+            // only events we don't care about
+            timeout = -1;
+            continue;
+        }
+
+        clock::time_point now = clock::now();
+        if (timeout < 0)
+            first = now;
+
+        int left = max_ms - std::chrono::duration_cast<std::chrono::milliseconds>(now - first).count();
+        if (n == 0 || left <= 0)
+            return true;
+
+        timeout = std::min<int>(quiet_ms, left);
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef SWAG_WATCH_H
+#define SWAG_WATCH_H
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// inotify watch over a gallery tree, for --watch
+//
+// every directory gets a watch of its own (inotify isn't recursive); new
+// directories are watched as they show up and "thumbs" is left out like
+// the scanner does. events are collected until the tree has been quiet for
+// a moment, so a copy of a hundred pictures comes back as one batch and a
+// file written in pieces as one change.
+//
+// a directory that appears or is moved in is reported as a directory
+// change and should be scanned; it may have been filled before its watch
+// existed. when the kernel queue overflows, the batch is a single change
+// for "", the whole tree.
+//
+// usage: 1) Watcher watcher(root, {".jpg", ".png"})
+//        2) watcher.start() before the initial scan, so nothing in between
+//           is missed
+//        3) watcher.wait(changes) in a loop, one batch per call
+class Watcher
+{
+public:
+    struct change
+    {
+        std::string path;       // relative to root, "" for all of it
+        bool directory = false;
+        bool removed = false;
+    };
+
+    // extensions are lowercase and include the dot; matching ignores case
+    Watcher(const std::string& root, const std::vector<std::string>& extensions);
+    ~Watcher();
+
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+
+    bool start();
+
+    // block until something changes, then gather events until none came
+    // for quiet_ms or max_ms went by since the first. changes are keyed by
+    // path, the last event on a path wins. false on a read error
+    bool wait(std::map<std::string, change>& changes, unsigned quiet_ms = 100, unsigned max_ms = 500);
+
+private:
+    void watch_tree(const std::string& dir);
+    void unwatch_tree(const std::string& dir);
+    void read_events(std::map<std::string, change>& changes);
+    bool wanted(const char* name) const;
+
+    std::string root;
+    std::vector<std::string> extensions;
+    int fd;
+    std::unordered_map<int, std::string> dirs;
+};
+
+#endif